@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "data.h"
+
+#define READERS_COUNT 8
+#define WRITERS_COUNT 2
+
+#define WRITER_USERS      30000
+#define MAX_BENCH_CHAT_ID (WRITER_USERS * WRITERS_COUNT)
+
+#define QUESTIONS_PAGE_SIZE 8
+
+static void *read_users(void *arg);
+static void *write_users(void *arg);
+static double get_elapsed_time(const struct timespec *start);
+
+static atomic_int writers_done = 0;
+static atomic_uint_fast64_t performed_reads = 0;
+
+// Readers look up random users while the writers create users, change
+// their states and questions, which is the contention of the workers
+// reading users while a few of them write.
+int main(void)
+{
+    init_data_module(DURABILITY_OFF, DEFAULT_FLUSH_INTERVAL_MS);
+
+    pthread_t readers[READERS_COUNT];
+    pthread_t writers[WRITERS_COUNT];
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < READERS_COUNT; ++i)
+        if (pthread_create(&readers[i], NULL, read_users, (void *) i))
+        {
+            fprintf(stderr, "failed to create a reader thread\n");
+            return EXIT_FAILURE;
+        }
+
+    for (long i = 0; i < WRITERS_COUNT; ++i)
+        if (pthread_create(&writers[i], NULL, write_users, (void *) i))
+        {
+            fprintf(stderr, "failed to create a writer thread\n");
+            return EXIT_FAILURE;
+        }
+
+    for (int i = 0; i < WRITERS_COUNT; ++i)
+        pthread_join(writers[i], NULL);
+
+    const double writes_time = get_elapsed_time(&start);
+    atomic_store(&writers_done, 1);
+
+    for (int i = 0; i < READERS_COUNT; ++i)
+        pthread_join(readers[i], NULL);
+
+    const double reads_time = get_elapsed_time(&start);
+    const uint_fast64_t reads = atomic_load(&performed_reads);
+
+    close_data_module();
+
+    printf("%d readers, %d writers\n", READERS_COUNT, WRITERS_COUNT);
+    printf("writes: %d users in %.3f s, %.0f per second\n",
+           WRITER_USERS * WRITERS_COUNT,
+           writes_time,
+           WRITER_USERS * WRITERS_COUNT / writes_time);
+    printf("reads: %ju in %.3f s, %.0f per second\n",
+           (uintmax_t) reads,
+           reads_time,
+           reads / reads_time);
+    printf("questions: %zu\n", get_questions_count());
+
+    return EXIT_SUCCESS;
+}
+
+static void *read_users(void *arg)
+{
+    unsigned int seed = (unsigned int) (long) arg + 1;
+    uint_fast64_t reads = 0;
+
+    while (!atomic_load(&writers_done))
+    {
+        UserSnapshot snapshot;
+        get_user_snapshot(rand_r(&seed) % MAX_BENCH_CHAT_ID + 1, &snapshot);
+
+        // Every few thousand lookups the reader pages the questions like /ls.
+        if (!(++reads & 0xFFF))
+            cJSON_Delete(get_questions(0, QUESTIONS_PAGE_SIZE));
+    }
+
+    atomic_fetch_add(&performed_reads, reads);
+
+    return NULL;
+}
+
+// Each writer owns every WRITERS_COUNT-th chat id, so they never write one user.
+static void *write_users(void *arg)
+{
+    const long writer = (long) arg;
+
+    for (int i = 0; i < WRITER_USERS; ++i)
+    {
+        const int_fast64_t chat_id = (int_fast64_t) i * WRITERS_COUNT + writer + 1;
+
+        create_user(chat_id);
+        create_question(chat_id, "bench question");
+
+        UserSnapshot snapshot;
+        get_user_snapshot(chat_id, &snapshot);
+
+        while (!compare_and_set_states(chat_id, &snapshot, snapshot.states ^ 1))
+            ;
+
+        if (i % 3)
+            delete_question(chat_id);
+    }
+
+    return NULL;
+}
+
+static double get_elapsed_time(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
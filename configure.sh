@@ -6,6 +6,7 @@ readonly ERRORSTAMP='\e[0;31;1mError:\e[0m'
 if [[ -f $CONFIG_FILE ]]; then
     bot_token=$(sed -nE 's/^\s*#define BOT_TOKEN\s+"(.*)"/\1/p' $CONFIG_FILE)
     root_chat_id=$(sed -nE 's/^\s*#define ROOT_CHAT_ID\s+(.+)/\1/p' $CONFIG_FILE)
+    webhook_secret_token=$(sed -nE 's/^\s*#define WEBHOOK_SECRET_TOKEN\s+"(.*)"/\1/p' $CONFIG_FILE)
 fi
 
 echo -e '\e[0;33;1mConfiguring bolochagina-tgbot...\e[0m'
@@ -36,6 +37,20 @@ else
     fi
 fi
 
+read -p 'Webhook secret token (leave empty to generate): ' new_webhook_secret_token
+
+if [[ -z $new_webhook_secret_token && -n $webhook_secret_token ]]; then
+    echo -e '\e[0;33;1mUsing existing webhook secret token...\e[0m'
+elif [[ -z $new_webhook_secret_token ]]; then
+    echo -e '\e[0;33;1mGenerating webhook secret token...\e[0m'
+    webhook_secret_token=$(tr -dc 'A-Za-z0-9_-' < /dev/urandom | head -c 64)
+elif [[ ! $new_webhook_secret_token =~ ^[A-Za-z0-9_-]{1,256}$ ]]; then
+    echo -e "$ERRORSTAMP webhook secret token must be 1-256 characters A-Z, a-z, 0-9, _ and -"
+    exit 1
+else
+    webhook_secret_token=$new_webhook_secret_token
+fi
+
 echo "// This file is autogenerated by configure.sh.
 
 #ifndef CONFIG_H
@@ -44,6 +59,8 @@ echo "// This file is autogenerated by configure.sh.
     #define BOT_TOKEN    \"$bot_token\"
     #define ROOT_CHAT_ID $root_chat_id
 
+    #define WEBHOOK_SECRET_TOKEN \"$webhook_secret_token\"
+
 #endif" > $CONFIG_FILE
 
 echo -e '\e[0;32;1mConfiguration done!\e[0m'
@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+    #define ARENA_H
+
+    #include <stddef.h>
+
+    #define ARENA_CHUNK_SIZE      65536
+    #define MAX_FREE_ARENA_CHUNKS 16
+
+    typedef struct Arena Arena;
+
+    // Called by the thread that releases the last reference to the arena.
+    typedef void (*ArenaCallback)(void *callback_arg);
+
+    void init_arena_module(void);
+    Arena *create_arena(void);
+    void *arena_alloc(Arena *arena, const size_t size);
+    void set_arena_callback(Arena *arena, ArenaCallback callback, void *callback_arg);
+    void use_arena(Arena *arena);
+    void retain_arena(Arena *arena);
+    void release_arena(Arena *arena);
+
+#endif
@@ -17,7 +17,36 @@
     #define COMMAND_LIST   "/ls"
     #define COMMAND_REMOVE "/rm"
 
-    #define MAX_COMMAND_REMOVE_SIZE 3
+    #define CALLBACK_LIST_PREV "ls_prev:"
+    #define CALLBACK_LIST_NEXT "ls_next:"
+
+    #define MAX_QUESTIONS_PAGE_SIZE 50
+
+    // Telegram limits the message text to 4096 UTF-16 code units.
+    #define MAX_MESSAGE_LENGTH 4096
+    #define MAX_BUTTON_SIZE    96
+    #define MAX_KEYBOARD_SIZE  (MAX_BUTTON_SIZE * 2 + 32)
+
+    // Only the beginning of a question is written to the event log.
+    #define MAX_LOGGED_QUESTION_SIZE 128
+
+    // Only one of these per-update events is logged.
+    #define UPDATE_EVENTS_SAMPLE_RATE 100
+
+    // Telegram limits the callback data to 64 bytes.
+    #define MAX_CALLBACK_DATA_SIZE 64
+    #define MAX_RECENT_TAPS        1024
+    #define REPEATED_TAP_WINDOW_US 3000000
+
+    #define WEBHOOK_ADDRESS "127.0.0.1"
+    #define WEBHOOK_PORT    8081
+    #define WEBHOOK_PATH    "/"
+
+    #define MAX_SECRET_TOKEN_SIZE 256
+
+    #define MAX_PENDING_BATCHES    64
+    #define SHUTDOWN_TIMEOUT_MS    10000
+    #define DRAIN_POLL_INTERVAL_MS 10
 
     #define FAQ_INLINEKEYBOARD "{\"inline_keyboard\":[" \
                                "[{\"text\":\"Фурнитура\",\"callback_data\":\"fittings\"}]," \
@@ -29,14 +58,148 @@
                                "[{\"text\":\"Количество креплений\",\"callback_data\":\"fastener_count\"}]" \
                                "]}"
 
-    #define NOKEYBOARD "{\"remove_keyboard\":true}"
+    #define FAQ_FITTINGS EMOJI_INFO " Фурнитура - это различные детали и механизмы для сборки и крепления конструкций\n\n" \
+                         "- Петли: для соединения подвижных элементов (двери, окна, крышки);\n" \
+                         "- Замки: для безопасности и блокировки;\n" \
+                         "- Ручки: для управления подвижными частями;\n" \
+                         "- Направляющие и ролики: для плавного движения;\n" \
+                         "- Газлифт: для мягкого закрытия дверей;\n" \
+                         "- Автоматические системы: дистанционное управление дверьми."
+
+    #define FAQ_MATERIALS EMOJI_INFO " Материалы в мебельном производстве\n\n" \
+                          "- Древесина: каркасы, фасады, столешницы;\n" \
+                          "- Фанера: фасады, задние стенки;\n" \
+                          "- ДСП: задние стенки, днища ящиков;\n" \
+                          "- МДФ: фасады, задние стенки;\n" \
+                          "- Стекло: фасады, столешницы;\n" \
+                          "- Металл: каркасы, опоры, ножки;\n" \
+                          "- Пластик: задние стенки, днища ящиков;\n" \
+                          "- Ткань: обивка мебели, чехлы."
+
+    #define FAQ_FASTENERS EMOJI_INFO " Крепёж - это элементы для соединения частей конструкций\n\n" \
+                          "- Саморезы: для деревянных деталей;\n" \
+                          "- Евровинт: с шестигранной головкой;\n" \
+                          "- Шканты: цилиндры из дерева;\n" \
+                          "- Стяжка: фиксация и выравнивание элементов;\n" \
+                          "- Эксцентрик: регулировка положения элементов.\n\n" \
+                          "Редактирование крепежа осуществляется в модуле Базис-Мебельщик."
+
+    #define FAQ_EDGE_BAND EMOJI_INFO " Кромка - материал для закрытия торцов панелей\n\n" \
+                          "- ПВХ-кромка: для ЛДСП, МДФ;\n" \
+                          "- Меламиновая: устойчива к влаге;\n" \
+                          "- Алюминиевая: защита от коррозии;\n" \
+                          "- Акриловая: устойчива к химии;\n" \
+                          "- Кромка из дерева: элегантный внешний вид;\n" \
+                          "- Кромка с плёнкой: декоративные варианты;\n" \
+                          "- Кромка с фрезеровкой: оригинальный дизайн."
+
+    #define FAQ_DESIGN_FUNCTIONS EMOJI_INFO " Функции проектирования\n\n" \
+                                 "- 'Растянуть и сдвинуть элементы': выделите область, укажите точку и переместите;\n" \
+                                 "- 'Растянуть и сдвинуть выделенные элементы': работает только с выделенными объектами;\n" \
+                                 "- 'Выделить окном': выделение элементов в зависимости от направления движения мыши."
+
+    #define FAQ_COPYING EMOJI_INFO " Функции копирования\n\n" \
+                        "- 'Копировать': вставка в другой файл;\n" \
+                        "- 'Копировать по точкам': внутри одного файла, возможен поворот и отражение."
+
+    #define FAQ_FASTENER_COUNT EMOJI_INFO " Количество креплений\n\n" \
+                               "- До 200 мм: 1 крепление;\n" \
+                               "- 200–700 мм: 2 крепления;\n" \
+                               "- 700–1200 мм: 3 крепления;\n" \
+                               "- 1200–2000 мм: 4 крепления;\n" \
+                               "- Более 2000 мм: 5 креплений.\n\n" \
+                               EMOJI_INFO " Количество петель\n\n" \
+                               "- До 950 мм: 2 петли;\n" \
+                               "- 950–1500 мм: 3 петли;\n" \
+                               "- 1500–2000 мм: 4 петли;\n" \
+                               "- Более 2000 мм: 5 петель."
+
+    // Routes are X(key, prefix, handler[, reply]), a prefix route matches
+    // inputs that start with its key and gets the rest as the argument.
+    #define COMMAND_ROUTES(X) \
+        X(COMMAND_FAQ,    0, handle_faq_command)    \
+        X(COMMAND_ASK,    0, handle_ask_command)    \
+        X(COMMAND_START,  0, handle_start_command)  \
+        X(COMMAND_LIST,   0, handle_list_command)   \
+        X(COMMAND_REMOVE, 1, handle_remove_command)
+
+    #define CALLBACK_ROUTES(X) \
+        X(CALLBACK_LIST_PREV, 1, handle_list_prev_callback, -1)                     \
+        X(CALLBACK_LIST_NEXT, 1, handle_list_next_callback, -1)                     \
+        X("fittings",         0, handle_faq_callback,       REPLY_FITTINGS)         \
+        X("materials",        0, handle_faq_callback,       REPLY_MATERIALS)        \
+        X("fasteners",        0, handle_faq_callback,       REPLY_FASTENERS)        \
+        X("edge_band",        0, handle_faq_callback,       REPLY_EDGE_BAND)        \
+        X("design_functions", 0, handle_faq_callback,       REPLY_DESIGN_FUNCTIONS) \
+        X("copying",          0, handle_faq_callback,       REPLY_COPYING)          \
+        X("fastener_count",   0, handle_faq_callback,       REPLY_FASTENER_COUNT)
+
+    #define KEYBOARDS(X) \
+        X(KEYBOARD_NONE,     "")                                                                                                          \
+        X(KEYBOARD_FAQ,      FAQ_INLINEKEYBOARD)                                                                                          \
+        X(KEYBOARD_QUESTION, "{\"keyboard\":[[{\"text\":\"" COMMAND_FAQ "\"}]],\"resize_keyboard\":true}")                                \
+        X(KEYBOARD_CANCEL,   "{\"keyboard\":[[{\"text\":\"" COMMAND_CANCEL "\"}]],\"resize_keyboard\":true}")                             \
+        X(KEYBOARD_DEFAULT,  "{\"keyboard\":[[{\"text\":\"" COMMAND_FAQ "\"},{\"text\":\"" COMMAND_ASK "\"}]],\"resize_keyboard\":true}")
+
+    #define STATIC_REPLIES(X) \
+        X(REPLY_MAINTENANCE,        EMOJI_FAILED " Извините, бот временно недоступен\n\n" \
+                                    "Проводятся технические работы. Пожалуйста, ожидайте!") \
+        X(REPLY_PRIVATE_CHATS_ONLY, EMOJI_FAILED " Извините, я могу работать только в личных сообщениях") \
+        X(REPLY_TEXT_ONLY,          EMOJI_FAILED " Извините, я понимаю только текст") \
+        X(REPLY_SLOW_DOWN,          EMOJI_ATTENTION " Вы отправляете сообщения слишком часто\n\n" \
+                                    "Пожалуйста, подождите немного") \
+        X(REPLY_QUESTION_CANCELLED, EMOJI_OK " Создание вопроса отменено") \
+        X(REPLY_USERNAME_REQUIRED,  EMOJI_FAILED " Извините, для этой функции вам нужно " \
+                                    "создать имя пользователя в настройках Telegram") \
+        X(REPLY_QUESTION_TOO_LARGE, EMOJI_FAILED " Извините, ваш вопрос слишком большой") \
+        X(REPLY_QUESTION_SAVED,     EMOJI_OK " Ваш вопрос сохранён\n\n" \
+                                    "Надеюсь вам ответят как можно быстрее!") \
+        X(REPLY_NEW_QUESTION,       EMOJI_INFO " Появился новый вопрос") \
+        X(REPLY_UNKNOWN_COMMAND,    EMOJI_FAILED " Извините, я не знаю такого действия") \
+        X(REPLY_FAQ,                EMOJI_QUESTION "Что вас интересует") \
+        X(REPLY_QUESTION_EXISTS,    EMOJI_FAILED " Извините, вы уже задали вопрос") \
+        X(REPLY_ASK_QUESTION,       EMOJI_WRITE " Задайте ваш вопрос") \
+        X(REPLY_ADMIN_HELP,         EMOJI_ATTENTION " ВЫ ЯВЛЯЕТЕСЬ АДМИНИСТРАТОРОМ\n\n" \
+                                    EMOJI_INFO " Вывести список вопросов\n" \
+                                    "/ls\n\n" \
+                                    EMOJI_INFO " Удалить вопрос\n" \
+                                    "/rm <id>\n\n" \
+                                    "Вместо <id> нужно указать идентификатор чата. " \
+                                    "Идентификатор находится перед вопросом пользователя в круглых скобках.") \
+        X(REPLY_ACCESS_DENIED,      EMOJI_FAILED " Извините, у вас недостаточно прав") \
+        X(REPLY_NO_QUESTIONS,       EMOJI_OK " Вопросов не найдено") \
+        X(REPLY_CHAT_ID_MISSING,    EMOJI_FAILED " Извините, вы не указали идентификатор чата") \
+        X(REPLY_CHAT_ID_INVALID,    EMOJI_FAILED " Извините, вы указали некорректный идентификатор чата") \
+        X(REPLY_USER_NOT_FOUND,     EMOJI_FAILED " Извините, такого пользователя не существует") \
+        X(REPLY_QUESTION_NOT_FOUND, EMOJI_FAILED " Извините, у пользователя нет вопроса") \
+        X(REPLY_QUESTION_SOLVED,    EMOJI_OK " Ваш вопрос был решён\n\n" \
+                                    "Если у вас остались ещё вопросы, не бойтесь задавать их снова!") \
+        X(REPLY_QUESTION_DELETED,   EMOJI_OK " Вопрос удалён") \
+        X(REPLY_FITTINGS,           FAQ_FITTINGS) \
+        X(REPLY_MATERIALS,          FAQ_MATERIALS) \
+        X(REPLY_FASTENERS,          FAQ_FASTENERS) \
+        X(REPLY_EDGE_BAND,          FAQ_EDGE_BAND) \
+        X(REPLY_DESIGN_FUNCTIONS,   FAQ_DESIGN_FUNCTIONS) \
+        X(REPLY_COPYING,            FAQ_COPYING) \
+        X(REPLY_FASTENER_COUNT,     FAQ_FASTENER_COUNT)
+
+    #define REPLY_ID(id, ...) id,
+
+    typedef enum
+    {
+        KEYBOARDS(REPLY_ID)
+        KEYBOARDS_COUNT
+    }
+    Keyboard;
 
-    #define get_current_keyboard(chat_id) (has_question(chat_id) ? \
-                                           "{\"keyboard\":[[{\"text\":\"" COMMAND_FAQ "\"}]],\"resize_keyboard\":true}" : \
-                                           (get_state(chat_id, "question_description_state") ? \
-                                            "{\"keyboard\":[[{\"text\":\"" COMMAND_CANCEL "\"}]],\"resize_keyboard\":true}" : \
-                                            "{\"keyboard\":[[{\"text\":\"" COMMAND_FAQ "\"},{\"text\":\"" COMMAND_ASK "\"}]],\"resize_keyboard\":true}"))
+    typedef enum
+    {
+        STATIC_REPLIES(REPLY_ID)
+        STATIC_REPLIES_COUNT
+    }
+    StaticReply;
 
-    void start_bot(const int maintenance_mode);
+    void start_bot(const int maintenance_mode, const int webhook_mode);
+    void stop_bot(void);
 
 #endif
@@ -1,24 +1,74 @@
 #ifndef DATA_H
     #define DATA_H
 
+    #include <stddef.h>
     #include <stdint.h>
 
     #include <cjson/cJSON.h>
 
-    #define FILE_USERS "/var/lib/bolochagina-tgbot/users.json"
+    // The bench build keeps its users in a scratch directory.
+    #ifndef DIR_USERS
+        #define DIR_USERS "/var/lib/bolochagina-tgbot/"
+    #endif
+
+    #define FILE_USERS         DIR_USERS "users.bin"
+    #define FILE_USERS_TMP     DIR_USERS "users.bin.tmp"
+    #define FILE_USERS_JSON    DIR_USERS "users.json"
+    #define FILE_USERS_LOG     DIR_USERS "users.log"
+    #define FILE_USERS_OLD_LOG DIR_USERS "users.log.old"
 
     #define MAX_USERNAME_SIZE 32
     #define MAX_CHAT_ID_SIZE  20
     #define MAX_QUESTION_SIZE 1024
 
-    void init_data_module(void);
-    int has_user(const int_fast64_t chat_id);
+    #define MIN_USERS_CAPACITY   1024
+    #define MAX_USERS_READERS    512
+    #define MAX_RETIRED_POINTERS 64
+
+    #define USERS_MAGIC   "BTGUSERS"
+    #define USERS_VERSION 2
+
+    #define MAX_USERS_LOG_SIZE 4194304
+    #define MAX_DIRTY_RECORDS  1024
+
+    #define DURABILITY_ALWAYS   0
+    #define DURABILITY_INTERVAL 1
+    #define DURABILITY_OFF      2
+
+    #define DEFAULT_FLUSH_INTERVAL_MS 100
+    #define MAX_FLUSH_INTERVAL_MS     60000
+
+    #define RECORD_CREATE_USER     1
+    #define RECORD_SET_STATES      2
+    #define RECORD_CREATE_QUESTION 3
+    #define RECORD_DELETE_QUESTION 4
+    #define RECORD_UPDATE_OFFSET   5
+
+    #define STATE_QUESTION_DESCRIPTION 0
+    #define STATES_COUNT               1
+
+    // A consistent view of one user, taken with a single lookup.
+    typedef struct
+    {
+        int exists;
+        uint32_t states;
+        int has_question;
+    }
+    UserSnapshot;
+
+    void init_data_module(const int durability_policy, const int flush_interval_ms);
+    void close_data_module(void);
+    size_t import_users(const char *json_path);
+    size_t export_users(const char *json_path);
+    int get_user_snapshot(const int_fast64_t chat_id, UserSnapshot *snapshot);
     void create_user(const int_fast64_t chat_id);
-    int get_state(const int_fast64_t chat_id, const char *state_name);
-    void set_state(const int_fast64_t chat_id, const char *state_name, const int state_value);
-    int has_question(const int_fast64_t chat_id);
+    int compare_and_set_states(const int_fast64_t chat_id, UserSnapshot *snapshot, const uint32_t states);
     void create_question(const int_fast64_t chat_id, const char *question_text);
-    void delete_question(const int_fast64_t chat_id);
-    cJSON *get_questions(void);
+    int delete_question(const int_fast64_t chat_id);
+    size_t get_questions_count(void);
+    cJSON *get_questions(const int_fast64_t cursor, const size_t limit);
+    cJSON *get_questions_before(const int_fast64_t cursor, const size_t limit);
+    int_fast64_t get_update_offset(void);
+    void set_update_offset(const int_fast64_t offset);
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef FLOOD_H
+    #define FLOOD_H
+
+    #include <stdint.h>
+
+    // Chats are limited with GCRA to one update per interval on average
+    // with bursts of FLOOD_BURST updates.
+    #define FLOOD_INTERVAL_US 1000000
+    #define FLOOD_BURST       8
+
+    // Chats are tracked in a fixed table, a chat is looked up among the
+    // FLOOD_PROBES slots after its hash.
+    #define MAX_FLOOD_CHATS 4096
+    #define FLOOD_PROBES    8
+
+    #define FLOOD_ALLOWED 0
+    #define FLOOD_LIMITED 1
+    #define FLOOD_WARNED  2
+
+    typedef struct
+    {
+        uint_fast64_t limited_updates;
+        uint_fast64_t warned_chats;
+        uint_fast64_t evicted_chats;
+    }
+    FloodStats;
+
+    int check_flood(const int_fast64_t chat_id);
+    void get_flood_stats(FloodStats *stats);
+
+#endif
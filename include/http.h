@@ -0,0 +1,44 @@
+#ifndef HTTP_H
+    #define HTTP_H
+
+    #include <stddef.h>
+
+    #define MAX_HTTP_CONNECTIONS  64
+    #define MAX_HTTP_REQUEST_SIZE 1048576
+    #define MAX_HTTP_HEADER_SIZE  8192
+    #define MAX_HTTP_IDLE_TIMEOUT 60
+    #define MAX_HTTP_SEND_TIMEOUT 5000
+
+    typedef struct
+    {
+        const char *method;
+        const char *path;
+        const char *headers;
+        const char *body;
+        size_t body_size;
+    }
+    HttpRequest;
+
+    typedef struct
+    {
+        int status;
+        const char *content_type;
+        char *body;
+        size_t body_size;
+    }
+    HttpResponse;
+
+    // The handler may set response->body to a malloc'd buffer, the server frees it.
+    typedef void (*HttpHandler)(const HttpRequest *request, HttpResponse *response, void *handler_arg);
+
+    void run_http_server(const char *address,
+                         const int port,
+                         HttpHandler handler,
+                         void *handler_arg);
+    void stop_http_server(void);
+    int get_http_header(const HttpRequest *request,
+                        const char *name,
+                        char *value,
+                        const size_t value_size);
+
+#endif
@@ -1,12 +1,91 @@
 #ifndef LOG_H
     #define LOG_H
 
+    #include <stdatomic.h>
+    #include <stddef.h>
+    #include <stdint.h>
+
     #define FILE_INFOLOG  "/var/log/bolochagina-tgbot/info_log"
+    #define FILE_EVENTLOG "/var/log/bolochagina-tgbot/event_log"
+    #define FILE_TRACELOG "/var/log/bolochagina-tgbot/trace_log"
     #define FILE_ERRORLOG "/var/log/bolochagina-tgbot/error_log"
 
+    #define MAX_LOG_PATH_SIZE  64
     #define MAX_TIMESTAMP_SIZE 21
 
+    // Records longer than MAX_LOG_RECORD_SIZE are truncated, records over
+    // the LOG_RING_SIZE pending ones are dropped and counted.
+    #define MAX_LOG_RECORD_SIZE 2048
+    #define LOG_RING_SIZE       512
+    #define LOG_BATCH_SIZE      64
+    #define LOG_WAIT_TIMEOUT_MS 1000
+
+    // The logs are rotated daily or when they would exceed the max size,
+    // the last MAX_ROTATED_LOGS rotated ones of each log are kept.
+    #define MAX_LOG_FILE_SIZE       16777216
+    #define MAX_ROTATED_LOGS        14
+    #define MAX_ROTATED_SUFFIX_SIZE 16
+    #define LOG_COMPRESSOR          "gzip"
+
+    #define LOG_LEVEL_DEBUG   0
+    #define LOG_LEVEL_INFO    1
+    #define LOG_LEVEL_WARNING 2
+    #define LOG_LEVEL_ERROR   3
+    #define LOG_LEVELS_COUNT  4
+
+    #define LOG_FIELD_INT    0
+    #define LOG_FIELD_STRING 1
+    #define LOG_FIELD_JSON   2
+
+    typedef struct
+    {
+        const char *key;
+        int type;
+        int_fast64_t integer;
+        const char *string;
+    }
+    LogField;
+
+    #define LOG_INT(key, value)    {(key), LOG_FIELD_INT, (value), NULL}
+    #define LOG_STRING(key, value) {(key), LOG_FIELD_STRING, 0, (value)}
+    #define LOG_JSON(key, value)   {(key), LOG_FIELD_JSON, 0, (value)}
+
+    #define LOG_EVENT(level, event, ...) \
+        log_event((level), \
+                  (event), \
+                  1, \
+                  (const LogField[]) {__VA_ARGS__}, \
+                  sizeof((const LogField[]) {__VA_ARGS__}) / sizeof(LogField))
+
+    // Keeps one of sample_rate events of the call site, warnings and errors
+    // are always kept. The fields of a skipped event are not evaluated.
+    #define LOG_SAMPLED_EVENT(level, event, sample_rate, ...) \
+        do \
+        { \
+            static atomic_uint_fast32_t log_event_counter = 0; \
+            \
+            if ((level) >= LOG_LEVEL_WARNING) \
+                LOG_EVENT((level), (event), __VA_ARGS__); \
+            else if (!(atomic_fetch_add(&log_event_counter, 1) % (sample_rate))) \
+                log_event((level), \
+                          (event), \
+                          (sample_rate), \
+                          (const LogField[]) {__VA_ARGS__}, \
+                          sizeof((const LogField[]) {__VA_ARGS__}) / sizeof(LogField)); \
+        } \
+        while (0)
+
+    void init_log_module(const int compress_logs, const int level);
+    void close_log_module(void);
+    void reopen_log(void);
+    int parse_log_level(const char *name);
     void report(const char *fmt, ...);
+    void log_event(const int level,
+                   const char *event,
+                   const int sample_rate,
+                   const LogField *fields,
+                   const size_t fields_count);
+    void log_trace(const char *event, const LogField *fields, const size_t fields_count);
     void die(const char *fmt, ...);
 
 #endif
@@ -0,0 +1,110 @@
+#ifndef METRICS_H
+    #define METRICS_H
+
+    #include <stdint.h>
+
+    #define METRICS_ADDRESS "127.0.0.1"
+    #define METRICS_PORT    9464
+    #define METRICS_PATH    "/metrics"
+
+    #define INITIAL_METRICS_SIZE 16384
+
+    // Histograms are log-linear: values below HISTOGRAM_SUB_BUCKETS are exact,
+    // each power of two above is split into HISTOGRAM_SUB_BUCKETS buckets,
+    // so a bucket bound is within 12.5% of any value in it.
+    #define HISTOGRAM_SUB_BUCKET_BITS 3
+    #define HISTOGRAM_SUB_BUCKETS     (1 << HISTOGRAM_SUB_BUCKET_BITS)
+    #define HISTOGRAM_BUCKETS         ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+    // Every scrape exports the same bounds: every HISTOGRAM_EXPORTED_STEP-th
+    // bucket below 2^36, two bounds per power of two.
+    // The larger values are counted only in the +Inf bucket.
+    #define HISTOGRAM_EXPORTED_STEP    (HISTOGRAM_SUB_BUCKETS / 2)
+    #define HISTOGRAM_EXPORTED_BUCKETS ((36 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+    #define COUNTERS(X) \
+        X(COUNTER_POLLED_UPDATES, \
+          "tgbot_polled_updates_total", \
+          "Updates received with getUpdates.") \
+        X(COUNTER_SAVED_USERS_BYTES, \
+          "tgbot_saved_users_bytes_total", \
+          "Bytes written to the users snapshots.") \
+        X(COUNTER_LOGGED_USERS_BYTES, \
+          "tgbot_logged_users_bytes_total", \
+          "Bytes appended to the users log.")
+
+    #define GAUGES(X) \
+        X(GAUGE_UPDATE_OFFSET, \
+          "tgbot_update_offset", \
+          "Next update_id requested with getUpdates.")
+
+    #define HISTOGRAMS(X) \
+        X(HISTOGRAM_POLL_LATENCY, \
+          "tgbot_poll_latency_us", \
+          "Time of a getUpdates long poll in microseconds.") \
+        X(HISTOGRAM_POLL_BATCH_SIZE, \
+          "tgbot_poll_batch_size", \
+          "Updates in a getUpdates batch.") \
+        X(HISTOGRAM_UPDATE_LATENCY, \
+          "tgbot_update_latency_us", \
+          "Time from submitting an update to finishing it in microseconds.") \
+        X(HISTOGRAM_HANDLER_TIME, \
+          "tgbot_handler_time_us", \
+          "Run time of an update handler in microseconds.") \
+        X(HISTOGRAM_SAVE_USERS_TIME, \
+          "tgbot_save_users_time_us", \
+          "Time of writing a users snapshot in microseconds.") \
+        X(HISTOGRAM_SAVE_USERS_SIZE, \
+          "tgbot_save_users_size_bytes", \
+          "Size of a users snapshot in bytes.")
+
+    // Requests are labelled with the Bot API method, unknown ones are
+    // counted as "other".
+    #define API_METHODS(X) \
+        X(API_METHOD_GET_UPDATES,           "getUpdates") \
+        X(API_METHOD_SEND_MESSAGE,          "sendMessage") \
+        X(API_METHOD_EDIT_MESSAGE_TEXT,     "editMessageText") \
+        X(API_METHOD_ANSWER_CALLBACK_QUERY, "answerCallbackQuery") \
+        X(API_METHOD_LEAVE_CHAT,            "leaveChat") \
+        X(API_METHOD_OTHER,                 "other")
+
+    #define METRIC_ID(id, ...) id,
+
+    typedef enum
+    {
+        COUNTERS(METRIC_ID)
+        COUNTERS_COUNT
+    }
+    Counter;
+
+    typedef enum
+    {
+        GAUGES(METRIC_ID)
+        GAUGES_COUNT
+    }
+    Gauge;
+
+    typedef enum
+    {
+        HISTOGRAMS(METRIC_ID)
+        HISTOGRAMS_COUNT
+    }
+    Histogram;
+
+    typedef enum
+    {
+        API_METHODS(METRIC_ID)
+        API_METHODS_COUNT
+    }
+    ApiMethod;
+
+    void start_metrics_server(void);
+    void add_counter(const Counter counter, const uint_fast64_t value);
+    void set_gauge(const Gauge gauge, const int_fast64_t value);
+    void record_histogram(const Histogram histogram, const int_fast64_t value);
+    ApiMethod get_api_method(const char *url);
+    const char *get_api_method_name(const ApiMethod method);
+    void record_request(const ApiMethod method, const int_fast64_t latency_us);
+    void count_request_retry(const ApiMethod method);
+
+#endif
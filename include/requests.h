@@ -1,11 +1,13 @@
 #ifndef REQUESTS_H
     #define REQUESTS_H
 
+    #include <stddef.h>
     #include <stdint.h>
 
     #include <cjson/cJSON.h>
 
     #include "config.h"
+    #include "arena.h"
 
     #define BOT_API_URL "https://api.telegram.org/bot" BOT_TOKEN
 
@@ -17,10 +19,75 @@
 
     #define MAX_REQUEST_RETRIES 3
 
+    #define MAX_CURL_HANDLES 16
+
+    #define MAX_ACTIVE_REQUESTS 64
+    #define MAX_QUEUED_REQUESTS 65536
+    #define MAX_POLL_TIMEOUT_MS 1000
+
+    // Telegram allows about 30 messages per second in total
+    // and about one message per second in a single chat.
+    #define GLOBAL_SEND_INTERVAL_US 34000
+    #define GLOBAL_SEND_BURST       30
+    #define CHAT_SEND_INTERVAL_US   1000000
+    #define CHAT_SEND_BURST         3
+
+    #define MAX_CHAT_LIMITS       4096
+    #define MAX_CHAT_LIMIT_PROBES 16
+
+    // Called on the requests thread once a queued request is completed.
+    // http_code is 0 if the request failed after all retries. Requests
+    // queued from a callback never wait for the queue to have room.
+    typedef void (*RequestCallback)(const long http_code, const char *response, void *callback_arg);
+
+    // URL-encoded message fields such as "&text=...", prepared once for
+    // the replies that never change.
+    typedef struct
+    {
+        const char *fields;
+        size_t fields_size;
+    }
+    EncodedFields;
+
+    typedef struct
+    {
+        uint_fast64_t performed_requests;
+        uint_fast64_t new_connections;
+        uint_fast64_t reused_connections;
+    }
+    ConnectionStats;
+
+    typedef struct
+    {
+        uint_fast64_t queued_requests;
+        uint_fast64_t active_requests;
+        uint_fast64_t failed_requests;
+        uint_fast64_t throttled_requests;
+        uint_fast64_t rate_limited_requests;
+    }
+    QueueStats;
+
     void init_requests_module(void);
+    void get_connection_stats(ConnectionStats *stats);
+    void get_queue_stats(QueueStats *stats);
 
-    cJSON *get_updates(const int_fast32_t update_id);
+    cJSON *get_updates(const int_fast32_t update_id, Arena *arena);
+    void stop_updates(void);
+    void queue_request(const char *url,
+                       const int_fast64_t chat_id,
+                       char *post_fields,
+                       RequestCallback callback,
+                       void *callback_arg);
     void leave_chat(const int_fast64_t chat_id);
     void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard);
+    void encode_fields(EncodedFields *fields, const char *name, const char *value);
+    void send_encoded_message(const int_fast64_t chat_id,
+                              const EncodedFields *message,
+                              const EncodedFields *keyboard);
+    void edit_message_with_keyboard(const int_fast64_t chat_id,
+                                    const int_fast64_t message_id,
+                                    const char *message,
+                                    const char *keyboard);
     void answer_callback_query(const char *callback_query_id);
+
 #endif
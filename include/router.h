@@ -0,0 +1,32 @@
+#ifndef ROUTER_H
+    #define ROUTER_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #define MAX_ROUTES       32
+    #define ROUTER_SLOTS     (MAX_ROUTES * 4)
+    #define MAX_ROUTER_SEEDS 1048576
+
+    // Prefix routes match the leading run of these characters and an
+    // optional ':' after it, such as "/rm" in "/rm 42" or "ls_next:" in
+    // "ls_next:1700000000".
+    #define ROUTE_PREFIX_CHARS "abcdefghijklmnopqrstuvwxyz_/"
+
+    typedef struct
+    {
+        const char *const *keys;
+        const int *prefixes;
+        size_t key_sizes[MAX_ROUTES];
+        uint32_t seed;
+        uint8_t slots[ROUTER_SLOTS];
+    }
+    Router;
+
+    void init_router(Router *router,
+                     const char *const *keys,
+                     const int *prefixes,
+                     const size_t keys_count);
+    int find_route(const Router *router, const char *input, const char **arg);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef TRACE_H
+    #define TRACE_H
+
+    #include <stdint.h>
+
+    #include "log.h"
+
+    // Spans over MAX_TRACE_SPANS are dropped and counted, the ones that do
+    // not fit MAX_LOG_RECORD_SIZE are left out of the written trace.
+    #define MAX_TRACE_SPANS        32
+    #define MAX_TRACE_SPANS_SIZE   (MAX_LOG_RECORD_SIZE - 256)
+    #define MAX_TRACE_THRESHOLD_MS 60000
+
+    // An update is traced from its receipt to its last Bot API request.
+    typedef struct Trace Trace;
+
+    void init_trace_module(const int threshold_ms);
+    Trace *start_trace(const int_fast64_t update_id, const int_fast64_t chat_id);
+    void retain_trace(Trace *trace);
+    void release_trace(Trace *trace);
+    void set_current_trace(Trace *trace);
+    Trace *get_current_trace(void);
+    int_fast64_t begin_span(void);
+    void end_span(const char *name, const int_fast64_t span_start);
+    void add_trace_span(Trace *trace,
+                        const char *name,
+                        const int_fast64_t span_start,
+                        const int_fast64_t span_end);
+
+#endif
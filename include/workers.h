@@ -0,0 +1,42 @@
+#ifndef WORKERS_H
+    #define WORKERS_H
+
+    #include <stdint.h>
+
+    #define MAX_WORKERS           256
+    #define MAX_WORKER_QUEUE_SIZE 256
+
+    // Admitted works over the shed limit make low-value works be shed,
+    // over the max limit all other works are deferred.
+    #define MAX_ADMITTED_WORKS  1024
+    #define SHED_ADMITTED_WORKS 768
+
+    #define WORK_ADMITTED 0
+    #define WORK_SHED     1
+    #define WORK_DEFERRED 2
+
+    typedef void (*WorkFunction)(void *work_arg);
+
+    typedef struct
+    {
+        uint_fast64_t workers;
+        uint_fast64_t busy_workers;
+        uint_fast64_t queued_works;
+        uint_fast64_t max_queued_works;
+        uint_fast64_t completed_works;
+        uint_fast64_t blocked_submits;
+        uint_fast64_t admitted_works;
+        uint_fast64_t shed_works;
+        uint_fast64_t deferred_works;
+        uint_fast64_t priority_works;
+    }
+    WorkersStats;
+
+    void init_workers_module(const int workers_count);
+    void submit_work(const int_fast64_t key, WorkFunction function, void *work_arg);
+    void submit_priority_work(WorkFunction function, void *work_arg);
+    int admit_work(const int low_value, const int can_wait);
+    void finish_admitted_work(void);
+    void get_workers_stats(WorkersStats *stats);
+
+#endif
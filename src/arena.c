@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdlib.h>
+
+#include <cjson/cJSON.h>
+
+#include "log.h"
+#include "arena.h"
+
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+}
+ArenaChunk;
+
+struct Arena
+{
+    ArenaChunk *chunks;
+    atomic_int references;
+    ArenaCallback callback;
+    void *callback_arg;
+};
+
+static void *allocate(size_t size);
+static void deallocate(void *pointer);
+static ArenaChunk *acquire_chunk(const size_t size);
+static void release_chunk(ArenaChunk *chunk);
+
+// cJSON allocates from the arena used by the current thread, if any.
+static _Thread_local Arena *current_arena = NULL;
+
+// Released chunks of the standard size are kept for the next batches.
+static ArenaChunk *free_chunks = NULL;
+static size_t free_chunks_count = 0;
+static pthread_mutex_t free_chunks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void init_arena_module(void)
+{
+    cJSON_Hooks hooks =
+    {
+        .malloc_fn = allocate,
+        .free_fn = deallocate
+    };
+
+    cJSON_InitHooks(&hooks);
+}
+
+// The arena is created with one reference, which is owned by the caller.
+Arena *create_arena(void)
+{
+    Arena *arena = malloc(sizeof *arena);
+
+    if (!arena)
+        die("%s: %s: failed to allocate memory for arena",
+            __BASE_FILE__,
+            __func__);
+
+    arena->chunks = NULL;
+    atomic_init(&arena->references, 1);
+    arena->callback = NULL;
+    arena->callback_arg = NULL;
+
+    return arena;
+}
+
+// Only the thread that created the arena allocates from it.
+void *arena_alloc(Arena *arena, const size_t size)
+{
+    const size_t aligned_size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    ArenaChunk *chunk = arena->chunks;
+
+    if (!chunk || chunk->size - chunk->used < aligned_size)
+    {
+        chunk = acquire_chunk(aligned_size > ARENA_CHUNK_SIZE ? aligned_size : ARENA_CHUNK_SIZE);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *pointer = (char *) chunk->data + chunk->used;
+    chunk->used += aligned_size;
+
+    return pointer;
+}
+
+void set_arena_callback(Arena *arena, ArenaCallback callback, void *callback_arg)
+{
+    arena->callback = callback;
+    arena->callback_arg = callback_arg;
+}
+
+void use_arena(Arena *arena)
+{
+    current_arena = arena;
+}
+
+void retain_arena(Arena *arena)
+{
+    atomic_fetch_add_explicit(&arena->references, 1, memory_order_relaxed);
+}
+
+// The whole arena is freed at once when its last reference is released.
+void release_arena(Arena *arena)
+{
+    if (atomic_fetch_sub_explicit(&arena->references, 1, memory_order_acq_rel) != 1)
+        return;
+
+    if (arena->callback)
+        arena->callback(arena->callback_arg);
+
+    while (arena->chunks)
+    {
+        ArenaChunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+
+        release_chunk(chunk);
+    }
+
+    free(arena);
+}
+
+static void *allocate(size_t size)
+{
+    return current_arena ? arena_alloc(current_arena, size) : malloc(size);
+}
+
+// The memory of the current arena is freed only with the arena itself.
+static void deallocate(void *pointer)
+{
+    if (!current_arena)
+        free(pointer);
+}
+
+static ArenaChunk *acquire_chunk(const size_t size)
+{
+    ArenaChunk *chunk = NULL;
+
+    if (size == ARENA_CHUNK_SIZE)
+    {
+        pthread_mutex_lock(&free_chunks_mutex);
+
+        if ((chunk = free_chunks))
+        {
+            free_chunks = chunk->next;
+            --free_chunks_count;
+        }
+
+        pthread_mutex_unlock(&free_chunks_mutex);
+    }
+
+    if (!chunk && !(chunk = malloc(sizeof *chunk + size)))
+        die("%s: %s: failed to allocate memory for chunk",
+            __BASE_FILE__,
+            __func__);
+
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+static void release_chunk(ArenaChunk *chunk)
+{
+    if (chunk->size == ARENA_CHUNK_SIZE)
+    {
+        pthread_mutex_lock(&free_chunks_mutex);
+
+        if (free_chunks_count < MAX_FREE_ARENA_CHUNKS)
+        {
+            chunk->next = free_chunks;
+            free_chunks = chunk;
+            ++free_chunks_count;
+
+            chunk = NULL;
+        }
+
+        pthread_mutex_unlock(&free_chunks_mutex);
+    }
+
+    free(chunk);
+}
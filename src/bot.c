@@ -1,9 +1,11 @@
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <cjson/cJSON.h>
 
@@ -11,165 +13,559 @@
 #include "log.h"
 #include "requests.h"
 #include "data.h"
+#include "http.h"
+#include "workers.h"
+#include "arena.h"
+#include "router.h"
+#include "flood.h"
+#include "metrics.h"
+#include "trace.h"
 #include "bot.h"
 
-static void handle_updates(cJSON *updates, const int maintenance_mode);
-static void *handle_message_in_maintenance_mode(void *cjson_message);
-static void *handle_message_in_default_mode(void *cjson_message);
-static void *handle_callback_query_in_maintenance_mode(void *cjson_callback_query);
-static void *handle_callback_query_in_default_mode(void *cjson_callback_query);
+// Handlers borrow the updates from the arena of their batch, the last
+// one to finish frees the whole batch.
+typedef struct
+{
+    int_fast64_t chat_id;
+    int_fast64_t submit_time;
+    int_fast64_t start_time;
+    WorkFunction function;
+    const cJSON *item;
+    Arena *arena;
+    Trace *trace;
+    int admitted;
+}
+UpdateWork;
+
+// Polled batches in their order. The offset is committed only past the
+// batches whose handlers have all finished.
+typedef struct
+{
+    int_fast32_t next_update_id;
+    int done;
+}
+PendingBatch;
+
+// The last button tapped in a chat. Chats sharing a slot overwrite each
+// other, so a repeated tap can only be missed, never made up.
+typedef struct
+{
+    int_fast64_t chat_id;
+    int_fast64_t tap_time;
+    char data[MAX_CALLBACK_DATA_SIZE + 1];
+}
+RecentTap;
+
+static void poll_updates(const int maintenance_mode);
+static void handle_updates(const cJSON *updates, Arena *arena, const int maintenance_mode);
+static int handle_update(const cJSON *update, Arena *arena, const int maintenance_mode, const int can_wait);
+static int submit_update_work(const int_fast64_t update_id,
+                              const int_fast64_t chat_id,
+                              WorkFunction function,
+                              const cJSON *item,
+                              Arena *arena,
+                              const int low_value,
+                              const int can_wait);
+static int is_repeated_tap(const int_fast64_t chat_id, const char *data);
+static void answer_dropped_update(const cJSON *item);
+static void run_update_work(void *update_work);
+static void finish_update_work(UpdateWork *work);
+static void handle_webhook_request(const HttpRequest *request, HttpResponse *response, void *maintenance_mode);
+static void handle_flooded_update(void *update_work);
+static void handle_message_in_maintenance_mode(void *update_work);
+static void handle_message_in_default_mode(void *update_work);
+static void handle_callback_query_in_maintenance_mode(void *update_work);
+static void handle_callback_query_in_default_mode(void *update_work);
 static void handle_question(const int_fast64_t chat_id,
+                            UserSnapshot *user,
                             const int root_access,
                             const char *username,
                             const char *question);
 static void handle_command(const int_fast64_t chat_id,
+                           UserSnapshot *user,
                            const int root_access,
                            const char *username,
                            const char *command);
-static void handle_faq_command(const int_fast64_t chat_id);
-static void handle_ask_command(const int_fast64_t chat_id, const char *username);
-static void handle_start_command(const int_fast64_t chat_id, const int root_access, const char *username);
-static void handle_list_command(const int_fast64_t chat_id, const int root_access);
-static void handle_remove_command(const int_fast64_t chat_id, const int root_access, const char *arg);
+static void handle_faq_command(const int_fast64_t chat_id,
+                               UserSnapshot *user,
+                               const int root_access,
+                               const char *username,
+                               const char *arg);
+static void handle_ask_command(const int_fast64_t chat_id,
+                               UserSnapshot *user,
+                               const int root_access,
+                               const char *username,
+                               const char *arg);
+static void handle_start_command(const int_fast64_t chat_id,
+                                 UserSnapshot *user,
+                                 const int root_access,
+                                 const char *username,
+                                 const char *arg);
+static void handle_list_command(const int_fast64_t chat_id,
+                                UserSnapshot *user,
+                                const int root_access,
+                                const char *username,
+                                const char *arg);
+static void handle_remove_command(const int_fast64_t chat_id,
+                                  UserSnapshot *user,
+                                  const int root_access,
+                                  const char *username,
+                                  const char *arg);
+static void handle_faq_callback(const int_fast64_t chat_id,
+                                const cJSON *callback_query,
+                                const char *arg,
+                                const int reply);
+static void handle_list_prev_callback(const int_fast64_t chat_id,
+                                      const cJSON *callback_query,
+                                      const char *arg,
+                                      const int reply);
+static void handle_list_next_callback(const int_fast64_t chat_id,
+                                      const cJSON *callback_query,
+                                      const char *arg,
+                                      const int reply);
+static void handle_list_callback(const int_fast64_t chat_id,
+                                 const cJSON *callback_query,
+                                 const char *arg,
+                                 const int backwards);
+static PendingBatch *reserve_batch(const int_fast32_t next_update_id);
+static void commit_batch(void *pending_batch);
+static void drain_bot(void);
+static void init_routers(void);
+static void init_replies(void);
+static void set_user_state(const int_fast64_t chat_id, UserSnapshot *user, const int state, const int state_value);
+static Keyboard get_user_keyboard(const UserSnapshot *user);
+static void send_reply(const int_fast64_t chat_id, const StaticReply reply, const Keyboard keyboard);
+static void send_questions_page(const int_fast64_t message_id, const int_fast64_t cursor, const int backwards);
+static size_t get_message_length(const char *message);
+static int get_logged_size(const char *text);
+static int_fast64_t get_monotonic_time(void);
+
+typedef void (*CommandHandler)(const int_fast64_t chat_id,
+                               UserSnapshot *user,
+                               const int root_access,
+                               const char *username,
+                               const char *arg);
+typedef void (*CallbackHandler)(const int_fast64_t chat_id,
+                                const cJSON *callback_query,
+                                const char *arg,
+                                const int reply);
+
+#define ROUTE_KEY(key, prefix, ...)              key,
+#define ROUTE_PREFIX(key, prefix, ...)           prefix,
+#define ROUTE_HANDLER(key, prefix, handler, ...) handler,
+#define ROUTE_REPLY(key, prefix, handler, reply) reply,
+
+static const char *const command_keys[] = {COMMAND_ROUTES(ROUTE_KEY)};
+static const int command_prefixes[] = {COMMAND_ROUTES(ROUTE_PREFIX)};
+static const CommandHandler command_handlers[] = {COMMAND_ROUTES(ROUTE_HANDLER)};
+
+static const char *const callback_keys[] = {CALLBACK_ROUTES(ROUTE_KEY)};
+static const int callback_prefixes[] = {CALLBACK_ROUTES(ROUTE_PREFIX)};
+static const CallbackHandler callback_handlers[] = {CALLBACK_ROUTES(ROUTE_HANDLER)};
+static const int callback_replies[] = {CALLBACK_ROUTES(ROUTE_REPLY)};
+
+#define REPLY_TEXT(id, text) text,
+
+static const char *const static_replies[] = {STATIC_REPLIES(REPLY_TEXT)};
+static const char *const keyboards[] = {KEYBOARDS(REPLY_TEXT)};
+
+static EncodedFields encoded_replies[STATIC_REPLIES_COUNT];
+static EncodedFields encoded_keyboards[KEYBOARDS_COUNT];
+
+static Router command_router;
+static Router callback_router;
 
 static int_fast32_t last_update_id = 0;
+static atomic_int bot_stopped = 0;
+
+static PendingBatch pending_batches[MAX_PENDING_BATCHES];
+static int pending_batches_head = 0;
+static int pending_batches_count = 0;
+static pthread_mutex_t pending_batches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_batches_cond = PTHREAD_COND_INITIALIZER;
+
+// Only the thread submitting the updates touches the recent taps.
+static RecentTap recent_taps[MAX_RECENT_TAPS];
+
+void start_bot(const int maintenance_mode, const int webhook_mode)
+{
+    init_routers();
+    init_replies();
+
+    if (webhook_mode)
+    {
+        int handler_maintenance_mode = maintenance_mode;
+
+        run_http_server(WEBHOOK_ADDRESS,
+                        WEBHOOK_PORT,
+                        handle_webhook_request,
+                        &handler_maintenance_mode);
+    }
+    else
+        poll_updates(maintenance_mode);
+
+    drain_bot();
+}
+
+// Only sets flags, so it is safe to call from a signal handler.
+void stop_bot(void)
+{
+    atomic_store(&bot_stopped, 1);
+
+    stop_updates();
+    stop_http_server();
+}
 
-void start_bot(const int maintenance_mode)
+static void poll_updates(const int maintenance_mode)
 {
-    for (;;)
+    // The maintenance mode runs without the data module.
+    if (!maintenance_mode)
+        last_update_id = get_update_offset();
+
+    while (!atomic_load(&bot_stopped))
     {
-        cJSON *updates = get_updates(last_update_id);
+        Arena *arena = create_arena();
+        const int_fast32_t batch_update_id = last_update_id;
+
+        set_gauge(GAUGE_UPDATE_OFFSET, last_update_id);
+        const cJSON *updates = get_updates(last_update_id, arena);
 
         if (updates)
-        {
-            handle_updates(updates, maintenance_mode);
-            cJSON_Delete(updates);
-        }
+            handle_updates(updates, arena, maintenance_mode);
+
+        if (!maintenance_mode && last_update_id != batch_update_id)
+            set_arena_callback(arena, commit_batch, reserve_batch(last_update_id));
+
+        release_arena(arena);
     }
 }
 
-static void handle_updates(cJSON *updates, const int maintenance_mode)
+static void handle_updates(const cJSON *updates, Arena *arena, const int maintenance_mode)
 {
     const cJSON *result = cJSON_GetObjectItem(updates, "result");
     const int result_size = cJSON_GetArraySize(result);
 
+    record_histogram(HISTOGRAM_POLL_BATCH_SIZE, result_size);
+    add_counter(COUNTER_POLLED_UPDATES, result_size);
+
     for (int i = 0; i < result_size; ++i)
     {
         const cJSON *update = cJSON_GetArrayItem(result, i);
         last_update_id = cJSON_GetNumberValue(cJSON_GetObjectItem(update, "update_id")) + 1;
 
-        const cJSON *message = cJSON_GetObjectItem(update, "message");
+        handle_update(update, arena, maintenance_mode, 1);
+    }
+}
+
+// Returns 0 if the update was deferred and has to be redelivered later.
+static int handle_update(const cJSON *update, Arena *arena, const int maintenance_mode, const int can_wait)
+{
+    const int_fast64_t update_id = cJSON_GetNumberValue(cJSON_GetObjectItem(update, "update_id"));
+    const cJSON *message = cJSON_GetObjectItem(update, "message");
+
+    // Updates of one chat are handled in order by the same worker.
+    if (message)
+        return submit_update_work(update_id,
+                                  cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(message, "chat"), "id")),
+                                  maintenance_mode ? handle_message_in_maintenance_mode : handle_message_in_default_mode,
+                                  message,
+                                  arena,
+                                  0,
+                                  can_wait);
+
+    const cJSON *callback_query = cJSON_GetObjectItem(update, "callback_query");
+
+    // Only a tap repeating the last one of its chat is shed under load,
+    // the answer to it is already on its way.
+    if (callback_query)
+    {
+        const int_fast64_t chat_id = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(callback_query, "from"), "id"));
+
+        return submit_update_work(update_id,
+                                  chat_id,
+                                  maintenance_mode ? handle_callback_query_in_maintenance_mode : handle_callback_query_in_default_mode,
+                                  callback_query,
+                                  arena,
+                                  is_repeated_tap(chat_id, cJSON_GetStringValue(cJSON_GetObjectItem(callback_query, "data"))),
+                                  can_wait);
+    }
 
-        if (message)
-        {
-            pthread_t handle_message_thread;
+    return 1;
+}
 
-            if (pthread_create(&handle_message_thread,
-                               NULL,
-                               maintenance_mode ? handle_message_in_maintenance_mode : handle_message_in_default_mode,
-                               cJSON_Duplicate(message, 1)))
-                die("%s: %s: failed to create handle_message_thread",
-                    __BASE_FILE__,
-                    __func__);
+static int submit_update_work(const int_fast64_t update_id,
+                              const int_fast64_t chat_id,
+                              WorkFunction function,
+                              const cJSON *item,
+                              Arena *arena,
+                              const int low_value,
+                              const int can_wait)
+{
+    // The trace starts at the receipt, so it covers the wait for admission.
+    Trace *trace = start_trace(update_id, chat_id);
+    const int_fast64_t receive_time = trace ? get_monotonic_time() : 0;
 
-            pthread_detach(handle_message_thread);
-        }
+    int warned = 0;
+    int admitted = 0;
 
-        const cJSON *callback_query = cJSON_GetObjectItem(update, "callback_query");
+    // The root chat bypasses the flood limit and the admission, so it
+    // stays responsive while the bot is overloaded.
+    if (chat_id != ROOT_CHAT_ID)
+    {
+        const int flood = check_flood(chat_id);
 
-        if (callback_query)
+        if (flood == FLOOD_LIMITED)
         {
-            pthread_t handle_callback_query_thread;
+            LOG_SAMPLED_EVENT(LOG_LEVEL_INFO,
+                              "update_flood_limited",
+                              UPDATE_EVENTS_SAMPLE_RATE,
+                              LOG_INT("chat_id", chat_id));
+            answer_dropped_update(item);
+            release_trace(trace);
+            return 1;
+        }
+
+        // The update is replaced with a single warning, which can be shed.
+        warned = flood == FLOOD_WARNED;
+
+        const int admission = admit_work(low_value || warned, can_wait);
 
-            if (pthread_create(&handle_callback_query_thread,
-                               NULL,
-                               maintenance_mode ? handle_callback_query_in_maintenance_mode : handle_callback_query_in_default_mode,
-                               cJSON_Duplicate(callback_query, 1)))
-                die("%s: %s: failed to create handle_callback_query_thread",
-                    __BASE_FILE__,
-                    __func__);
+        if (admission == WORK_SHED)
+        {
+            LOG_SAMPLED_EVENT(LOG_LEVEL_INFO,
+                              "update_shed",
+                              UPDATE_EVENTS_SAMPLE_RATE,
+                              LOG_INT("chat_id", chat_id));
+            answer_dropped_update(item);
+            release_trace(trace);
+            return 1;
+        }
 
-            pthread_detach(handle_callback_query_thread);
+        if (admission == WORK_DEFERRED)
+        {
+            release_trace(trace);
+            return 0;
         }
+
+        admitted = 1;
     }
+
+    UpdateWork *work = arena_alloc(arena, sizeof *work);
+
+    work->chat_id = chat_id;
+    work->submit_time = get_monotonic_time();
+    work->function = warned ? handle_flooded_update : function;
+    work->item = item;
+    work->arena = arena;
+    work->trace = trace;
+    work->admitted = admitted;
+
+    add_trace_span(trace, "admission", receive_time, work->submit_time);
+    retain_arena(arena);
+
+    if (admitted)
+        submit_work(chat_id, run_update_work, work);
+    else
+        submit_priority_work(run_update_work, work);
+
+    return 1;
 }
 
-static void *handle_message_in_maintenance_mode(void *cjson_message)
+// Remembers the tap, so it is repeated only by the same data within
+// REPEATED_TAP_WINDOW_US after the previous one.
+static int is_repeated_tap(const int_fast64_t chat_id, const char *data)
 {
-    cJSON *message = cjson_message;
+    if (!data)
+        return 0;
+
+    const int_fast64_t now = get_monotonic_time();
+    RecentTap *tap = &recent_taps[(uint_fast64_t) chat_id * 0x9E3779B97F4A7C15 % MAX_RECENT_TAPS];
+
+    const int repeated = tap->chat_id == chat_id &&
+                         now - tap->tap_time < REPEATED_TAP_WINDOW_US &&
+                         !strncmp(tap->data, data, MAX_CALLBACK_DATA_SIZE);
 
-    send_message_with_keyboard(cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(message, "chat"), "id")),
-                               EMOJI_FAILED " Извините, бот временно недоступен\n\n"
-                               "Проводятся технические работы. Пожалуйста, ожидайте!",
-                               "");
+    tap->chat_id = chat_id;
+    tap->tap_time = now;
+    snprintf(tap->data, sizeof tap->data, "%s", data);
 
-    cJSON_Delete(message);
-    return NULL;
+    return repeated;
 }
 
-static void *handle_message_in_default_mode(void *cjson_message)
+// Only callback queries have an id, a dropped tap is still answered
+// so the client stops waiting for it.
+static void answer_dropped_update(const cJSON *item)
 {
-    cJSON *message = cjson_message;
+    const char *callback_query_id = cJSON_GetStringValue(cJSON_GetObjectItem(item, "id"));
+
+    if (callback_query_id)
+        answer_callback_query(callback_query_id);
+}
+
+// The work is freed with the arena by the handler, so the trace is kept
+// apart to be finished after it.
+static void run_update_work(void *update_work)
+{
+    UpdateWork *work = update_work;
+    Trace *trace = work->trace;
+
+    work->start_time = get_monotonic_time();
+    add_trace_span(trace, "worker_queue", work->submit_time, work->start_time);
+
+    set_current_trace(trace);
+    const int_fast64_t span_start = begin_span();
+
+    work->function(work);
+
+    end_span("handler", span_start);
+    set_current_trace(NULL);
+    release_trace(trace);
+}
+
+static void finish_update_work(UpdateWork *work)
+{
+    const int_fast64_t finish_time = get_monotonic_time();
+
+    record_histogram(HISTOGRAM_HANDLER_TIME, finish_time - work->start_time);
+    record_histogram(HISTOGRAM_UPDATE_LATENCY, finish_time - work->submit_time);
+
+    LOG_SAMPLED_EVENT(LOG_LEVEL_DEBUG,
+                      "update_handled",
+                      UPDATE_EVENTS_SAMPLE_RATE,
+                      LOG_INT("chat_id", work->chat_id),
+                      LOG_INT("latency_us", finish_time - work->submit_time));
+
+    if (work->admitted)
+        finish_admitted_work();
+
+    release_arena(work->arena);
+}
+
+static void handle_webhook_request(const HttpRequest *request, HttpResponse *response, void *maintenance_mode)
+{
+    char secret_token[MAX_SECRET_TOKEN_SIZE + 1];
+
+    if (strcmp(request->path, WEBHOOK_PATH))
+        response->status = 404;
+    else if (strcmp(request->method, "POST"))
+        response->status = 405;
+    else if (!get_http_header(request,
+                              "X-Telegram-Bot-Api-Secret-Token",
+                              secret_token,
+                              sizeof secret_token) ||
+             strcmp(secret_token, WEBHOOK_SECRET_TOKEN))
+        response->status = 403;
+    else
+    {
+        Arena *arena = create_arena();
+
+        use_arena(arena);
+        const cJSON *update = cJSON_Parse(request->body);
+        use_arena(NULL);
+
+        // Telegram redelivers the deferred update after the error.
+        if (!update)
+            response->status = 400;
+        else if (!handle_update(update, arena, *(int *) maintenance_mode, 0))
+            response->status = 429;
+
+        release_arena(arena);
+    }
+}
+
+static void handle_flooded_update(void *update_work)
+{
+    UpdateWork *work = update_work;
+
+    send_reply(work->chat_id,
+               REPLY_SLOW_DOWN,
+               KEYBOARD_NONE);
+
+    finish_update_work(work);
+}
+
+static void handle_message_in_maintenance_mode(void *update_work)
+{
+    UpdateWork *work = update_work;
+    const cJSON *message = work->item;
+
+    send_reply(cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(message, "chat"), "id")),
+               REPLY_MAINTENANCE,
+               KEYBOARD_NONE);
+
+    finish_update_work(work);
+}
+
+static void handle_message_in_default_mode(void *update_work)
+{
+    UpdateWork *work = update_work;
+    const cJSON *message = work->item;
 
     const cJSON *chat = cJSON_GetObjectItem(message, "chat");
     const int_fast64_t chat_id = cJSON_GetNumberValue(cJSON_GetObjectItem(chat, "id"));
 
     if (strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(chat, "type")), "private"))
     {
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, я могу работать только в личных сообщениях",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_PRIVATE_CHATS_ONLY,
+                   KEYBOARD_NONE);
         leave_chat(chat_id);
         goto exit;
     }
 
     const int root_access = (chat_id == ROOT_CHAT_ID);
 
-    if (!has_user(chat_id))
+    // The handlers keep the snapshot up to date with their own changes.
+    UserSnapshot user;
+
+    if (!get_user_snapshot(chat_id, &user))
     {
         create_user(chat_id);
-        report("New user %" PRIdFAST64
-               " appeared",
-               chat_id);
+        LOG_EVENT(LOG_LEVEL_INFO,
+                  "user_created",
+                  LOG_INT("chat_id", chat_id));
+
+        user.exists = 1;
     }
 
     const cJSON *username = cJSON_GetObjectItem(chat, "username");
     const cJSON *text = cJSON_GetObjectItem(message, "text");
 
-    if (get_state(chat_id, "question_description_state"))
+    if ((user.states >> STATE_QUESTION_DESCRIPTION) & 1)
         handle_question(chat_id,
+                        &user,
                         root_access,
                         username ? username->valuestring : NULL,
                         text ? text->valuestring : NULL);
     else
         handle_command(chat_id,
+                       &user,
                        root_access,
                        username ? username->valuestring : NULL,
                        text ? text->valuestring : NULL);
 
 exit:
-    cJSON_Delete(message);
-    return NULL;
+    finish_update_work(work);
 }
 
-static void *handle_callback_query_in_maintenance_mode(void *cjson_callback_query)
+static void handle_callback_query_in_maintenance_mode(void *update_work)
 {
-    cJSON *callback_query = cjson_callback_query;
+    UpdateWork *work = update_work;
+    const cJSON *callback_query = work->item;
 
     answer_callback_query(cJSON_GetStringValue(cJSON_GetObjectItem(callback_query, "id")));
 
-    send_message_with_keyboard(cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(callback_query, "from"), "id")),
-                               EMOJI_FAILED " Извините, бот временно недоступен\n\n"
-                               "Проводятся технические работы. Пожалуйста, ожидайте!",
-                               "");
+    send_reply(cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(callback_query, "from"), "id")),
+               REPLY_MAINTENANCE,
+               KEYBOARD_NONE);
 
-    cJSON_Delete(callback_query);
-    return NULL;
+    finish_update_work(work);
 }
 
-static void *handle_callback_query_in_default_mode(void *cjson_callback_query)
+static void handle_callback_query_in_default_mode(void *update_work)
 {
-    cJSON *callback_query = cjson_callback_query;
+    UpdateWork *work = update_work;
+    const cJSON *callback_query = work->item;
 
     const char *callback_query_id = cJSON_GetStringValue(cJSON_GetObjectItem(callback_query, "id"));
     const char *callback_query_data = cJSON_GetStringValue(cJSON_GetObjectItem(callback_query, "data"));
@@ -178,118 +574,52 @@ static void *handle_callback_query_in_default_mode(void *cjson_callback_query)
 
     const int_fast64_t chat_id = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetObjectItem(callback_query, "from"), "id"));
 
-    if (!strcmp(callback_query_data, "fittings"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Фурнитура - это различные детали и механизмы для сборки и крепления конструкций\n\n"
-                                   "- Петли: для соединения подвижных элементов (двери, окна, крышки);\n"
-                                   "- Замки: для безопасности и блокировки;\n"
-                                   "- Ручки: для управления подвижными частями;\n"
-                                   "- Направляющие и ролики: для плавного движения;\n"
-                                   "- Газлифт: для мягкого закрытия дверей;\n"
-                                   "- Автоматические системы: дистанционное управление дверьми.",
-                                   "");
-    else if (!strcmp(callback_query_data, "materials"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Материалы в мебельном производстве\n\n"
-                                   "- Древесина: каркасы, фасады, столешницы;\n"
-                                   "- Фанера: фасады, задние стенки;\n"
-                                   "- ДСП: задние стенки, днища ящиков;\n"
-                                   "- МДФ: фасады, задние стенки;\n"
-                                   "- Стекло: фасады, столешницы;\n"
-                                   "- Металл: каркасы, опоры, ножки;\n"
-                                   "- Пластик: задние стенки, днища ящиков;\n"
-                                   "- Ткань: обивка мебели, чехлы.",
-                                   "");
-    else if (!strcmp(callback_query_data, "fasteners"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Крепёж - это элементы для соединения частей конструкций\n\n"
-                                   "- Саморезы: для деревянных деталей;\n"
-                                   "- Евровинт: с шестигранной головкой;\n"
-                                   "- Шканты: цилиндры из дерева;\n"
-                                   "- Стяжка: фиксация и выравнивание элементов;\n"
-                                   "- Эксцентрик: регулировка положения элементов.\n\n"
-                                   "Редактирование крепежа осуществляется в модуле Базис-Мебельщик.",
-                                   "");
-    else if (!strcmp(callback_query_data, "edge_band"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Кромка - материал для закрытия торцов панелей\n\n"
-                                   "- ПВХ-кромка: для ЛДСП, МДФ;\n"
-                                   "- Меламиновая: устойчива к влаге;\n"
-                                   "- Алюминиевая: защита от коррозии;\n"
-                                   "- Акриловая: устойчива к химии;\n"
-                                   "- Кромка из дерева: элегантный внешний вид;\n"
-                                   "- Кромка с плёнкой: декоративные варианты;\n"
-                                   "- Кромка с фрезеровкой: оригинальный дизайн.",
-                                   "");
-    else if (!strcmp(callback_query_data, "design_functions"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Функции проектирования\n\n"
-                                   "- 'Растянуть и сдвинуть элементы': выделите область, укажите точку и переместите;\n"
-                                   "- 'Растянуть и сдвинуть выделенные элементы': работает только с выделенными объектами;\n"
-                                   "- 'Выделить окном': выделение элементов в зависимости от направления движения мыши.",
-                                   "");
-    else if (!strcmp(callback_query_data, "copying"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Функции копирования\n\n"
-                                   "- 'Копировать': вставка в другой файл;\n"
-                                   "- 'Копировать по точкам': внутри одного файла, возможен поворот и отражение.",
-                                   "");
-    else if (!strcmp(callback_query_data, "fastener_count"))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_INFO " Количество креплений\n\n"
-                                   "- До 200 мм: 1 крепление;\n"
-                                   "- 200–700 мм: 2 крепления;\n"
-                                   "- 700–1200 мм: 3 крепления;\n"
-                                   "- 1200–2000 мм: 4 крепления;\n"
-                                   "- Более 2000 мм: 5 креплений.\n\n"
-                                   EMOJI_INFO " Количество петель\n\n"
-                                   "- До 950 мм: 2 петли;\n"
-                                   "- 950–1500 мм: 3 петли;\n"
-                                   "- 1500–2000 мм: 4 петли;\n"
-                                   "- Более 2000 мм: 5 петель.",
-                                   "");
-
-    cJSON_Delete(callback_query);
-    return NULL;
+    const char *arg;
+    const int route = find_route(&callback_router, callback_query_data, &arg);
+
+    if (route >= 0)
+        callback_handlers[route](chat_id, callback_query, arg, callback_replies[route]);
+
+    finish_update_work(work);
 }
 
 static void handle_question(const int_fast64_t chat_id,
+                            UserSnapshot *user,
                             const int root_access,
                             const char *username,
                             const char *question)
 {
     if (!question)
     {
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, я понимаю только текст",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_TEXT_ONLY,
+                   KEYBOARD_NONE);
         return;
     }
 
     if (!strcmp(question, COMMAND_CANCEL))
     {
-        set_state(chat_id, "question_description_state", 0);
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_OK " Создание вопроса отменено",
-                                   get_current_keyboard(chat_id));
+        set_user_state(chat_id, user, STATE_QUESTION_DESCRIPTION, 0);
+        send_reply(chat_id,
+                   REPLY_QUESTION_CANCELLED,
+                   get_user_keyboard(user));
         return;
     }
 
     if (!username)
     {
-        set_state(chat_id, "question_description_state", 0);
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, для этой функции вам нужно "
-                                   "создать имя пользователя в настройках Telegram",
-                                   get_current_keyboard(chat_id));
+        set_user_state(chat_id, user, STATE_QUESTION_DESCRIPTION, 0);
+        send_reply(chat_id,
+                   REPLY_USERNAME_REQUIRED,
+                   get_user_keyboard(user));
         return;
     }
 
     if (strlen(question) > MAX_QUESTION_SIZE)
     {
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, ваш вопрос слишком большой",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_QUESTION_TOO_LARGE,
+                   KEYBOARD_NONE);
         return;
     }
 
@@ -301,89 +631,114 @@ static void handle_question(const int_fast64_t chat_id,
              question);
 
     create_question(chat_id, username_with_question);
-    set_state(chat_id, "question_description_state", 0);
+    user->has_question = 1;
 
-    report("User %" PRIdFAST64
-           " with username '%s'"
-           " created question '%s'",
-           chat_id,
-           username,
-           question);
+    set_user_state(chat_id, user, STATE_QUESTION_DESCRIPTION, 0);
 
-    send_message_with_keyboard(chat_id,
-                               EMOJI_OK " Ваш вопрос сохранён\n\n"
-                               "Надеюсь вам ответят как можно быстрее!",
-                               get_current_keyboard(chat_id));
+    const int logged_question_size = get_logged_size(question);
+
+    char logged_question[MAX_LOGGED_QUESTION_SIZE + 4];
+    snprintf(logged_question,
+             sizeof logged_question,
+             "%.*s%s",
+             logged_question_size,
+             question,
+             question[logged_question_size] ? "..." : "");
+
+    LOG_EVENT(LOG_LEVEL_INFO,
+              "question_created",
+              LOG_INT("chat_id", chat_id),
+              LOG_STRING("username", username),
+              LOG_STRING("question", logged_question));
+
+    send_reply(chat_id,
+               REPLY_QUESTION_SAVED,
+               get_user_keyboard(user));
 
     if (!root_access)
-        send_message_with_keyboard(ROOT_CHAT_ID,
-                                   EMOJI_INFO " Появился новый вопрос",
-                                   "");
+        send_reply(ROOT_CHAT_ID,
+                   REPLY_NEW_QUESTION,
+                   KEYBOARD_NONE);
 }
 
 static void handle_command(const int_fast64_t chat_id,
+                           UserSnapshot *user,
                            const int root_access,
                            const char *username,
                            const char *command)
 {
     if (!command)
     {
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, я понимаю только текст",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_TEXT_ONLY,
+                   KEYBOARD_NONE);
         return;
     }
 
-    if (!strcmp(command, COMMAND_FAQ))
-        handle_faq_command(chat_id);
-    else if (!strcmp(command, COMMAND_ASK))
-        handle_ask_command(chat_id, username);
-    else if (!strcmp(command, COMMAND_START))
-        handle_start_command(chat_id, root_access, username);
-    else if (!strcmp(command, COMMAND_LIST))
-        handle_list_command(chat_id, root_access);
-    else if (!strncmp(command, COMMAND_REMOVE, MAX_COMMAND_REMOVE_SIZE))
-        handle_remove_command(chat_id,
-                              root_access,
-                              command + MAX_COMMAND_REMOVE_SIZE);
+    const char *arg;
+    const int route = find_route(&command_router, command, &arg);
+
+    if (route >= 0)
+        command_handlers[route](chat_id, user, root_access, username, arg);
     else
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, я не знаю такого действия",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_UNKNOWN_COMMAND,
+                   KEYBOARD_NONE);
 }
 
-static void handle_faq_command(const int_fast64_t chat_id)
+static void handle_faq_command(const int_fast64_t chat_id,
+                               UserSnapshot *user,
+                               const int root_access,
+                               const char *username,
+                               const char *arg)
 {
-    send_message_with_keyboard(chat_id,
-                               EMOJI_QUESTION "Что вас интересует",
-                               FAQ_INLINEKEYBOARD);
+    (void) user;
+    (void) root_access;
+    (void) username;
+    (void) arg;
+
+    send_reply(chat_id,
+               REPLY_FAQ,
+               KEYBOARD_FAQ);
 }
 
-static void handle_ask_command(const int_fast64_t chat_id, const char *username)
+static void handle_ask_command(const int_fast64_t chat_id,
+                               UserSnapshot *user,
+                               const int root_access,
+                               const char *username,
+                               const char *arg)
 {
-    if (has_question(chat_id))
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, вы уже задали вопрос",
-                                   "");
+    (void) root_access;
+    (void) arg;
+
+    if (user->has_question)
+        send_reply(chat_id,
+                   REPLY_QUESTION_EXISTS,
+                   KEYBOARD_NONE);
     else
     {
         if (!username)
-            send_message_with_keyboard(chat_id,
-                                       EMOJI_FAILED " Извините, для этой функции вам нужно "
-                                       "создать имя пользователя в настройках Telegram",
-                                       "");
+            send_reply(chat_id,
+                       REPLY_USERNAME_REQUIRED,
+                       KEYBOARD_NONE);
         else
         {
-            set_state(chat_id, "question_description_state", 1);
-            send_message_with_keyboard(chat_id,
-                                       EMOJI_WRITE " Задайте ваш вопрос",
-                                       get_current_keyboard(chat_id));
+            set_user_state(chat_id, user, STATE_QUESTION_DESCRIPTION, 1);
+            send_reply(chat_id,
+                       REPLY_ASK_QUESTION,
+                       get_user_keyboard(user));
         }
     }
 }
 
-static void handle_start_command(const int_fast64_t chat_id, const int root_access, const char *username)
+static void handle_start_command(const int_fast64_t chat_id,
+                                 UserSnapshot *user,
+                                 const int root_access,
+                                 const char *username,
+                                 const char *arg)
 {
+    (void) arg;
+
     const char *user_greeting = EMOJI_GREETING " Добро пожаловать";
 
     char start_message[strlen(user_greeting) + MAX_USERNAME_SIZE + 3];
@@ -402,97 +757,454 @@ static void handle_start_command(const int_fast64_t chat_id, const int root_acce
 
     send_message_with_keyboard(chat_id,
                                start_message,
-                               get_current_keyboard(chat_id));
+                               keyboards[get_user_keyboard(user)]);
 
     if (root_access)
-        send_message_with_keyboard(ROOT_CHAT_ID,
-                                   EMOJI_ATTENTION " ВЫ ЯВЛЯЕТЕСЬ АДМИНИСТРАТОРОМ\n\n"
-                                   EMOJI_INFO " Вывести список вопросов\n"
-                                   "/ls\n\n"
-                                   EMOJI_INFO " Удалить вопрос\n"
-                                   "/rm <id>\n\n"
-                                   "Вместо <id> нужно указать идентификатор чата. "
-                                   "Идентификатор находится перед вопросом пользователя в круглых скобках.",
-                                   "");
+        send_reply(ROOT_CHAT_ID,
+                   REPLY_ADMIN_HELP,
+                   KEYBOARD_NONE);
 }
 
-static void handle_list_command(const int_fast64_t chat_id, const int root_access)
+static void handle_list_command(const int_fast64_t chat_id,
+                                UserSnapshot *user,
+                                const int root_access,
+                                const char *username,
+                                const char *arg)
 {
+    (void) user;
+    (void) username;
+    (void) arg;
+
     if (!root_access)
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, у вас недостаточно прав",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_ACCESS_DENIED,
+                   KEYBOARD_NONE);
     else
-    {
-        cJSON *questions = get_questions();
-        const int questions_size = cJSON_GetArraySize(questions);
-
-        if (!questions_size)
-            send_message_with_keyboard(ROOT_CHAT_ID,
-                                       EMOJI_OK " Вопросов не найдено",
-                                       "");
-        else
-            for (int i = 0; i < questions_size; ++i)
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           cJSON_GetStringValue(cJSON_GetArrayItem(questions, i)),
-                                           i + 1 != questions_size ? NOKEYBOARD : get_current_keyboard(ROOT_CHAT_ID));
-
-        cJSON_Delete(questions);
-    }
+        send_questions_page(0, 0, 0);
 }
 
-static void handle_remove_command(const int_fast64_t chat_id, const int root_access, const char *arg)
+static void handle_remove_command(const int_fast64_t chat_id,
+                                  UserSnapshot *user,
+                                  const int root_access,
+                                  const char *username,
+                                  const char *arg)
 {
+    (void) username;
+
     if (!root_access)
-        send_message_with_keyboard(chat_id,
-                                   EMOJI_FAILED " Извините, у вас недостаточно прав",
-                                   "");
+        send_reply(chat_id,
+                   REPLY_ACCESS_DENIED,
+                   KEYBOARD_NONE);
     else
     {
         while (*arg == ' ')
             ++arg;
 
         if (!*arg)
-            send_message_with_keyboard(ROOT_CHAT_ID,
-                                       EMOJI_FAILED " Извините, вы не указали идентификатор чата",
-                                       "");
+            send_reply(ROOT_CHAT_ID,
+                       REPLY_CHAT_ID_MISSING,
+                       KEYBOARD_NONE);
         else
         {
             char *end;
             const int_fast64_t target_chat_id = strtoll(arg, &end, 10);
 
+            UserSnapshot target_user;
+
             if (*end || end == arg)
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           EMOJI_FAILED " Извините, вы указали некорректный идентификатор чата",
-                                           "");
-            else if (!has_user(target_chat_id))
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           EMOJI_FAILED " Извините, такого пользователя не существует",
-                                           "");
-            else if (!has_question(target_chat_id))
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           EMOJI_FAILED " Извините, у пользователя нет вопроса",
-                                           "");
+                send_reply(ROOT_CHAT_ID,
+                           REPLY_CHAT_ID_INVALID,
+                           KEYBOARD_NONE);
+            else if (!get_user_snapshot(target_chat_id, &target_user))
+                send_reply(ROOT_CHAT_ID,
+                           REPLY_USER_NOT_FOUND,
+                           KEYBOARD_NONE);
+            else if (!delete_question(target_chat_id))
+                send_reply(ROOT_CHAT_ID,
+                           REPLY_QUESTION_NOT_FOUND,
+                           KEYBOARD_NONE);
             else
             {
-                delete_question(target_chat_id);
+                target_user.has_question = 0;
 
-                report("User %" PRIdFAST64
-                       " deleted user %" PRIdFAST64
-                       " question",
-                       ROOT_CHAT_ID,
-                       target_chat_id);
+                if (chat_id == target_chat_id)
+                    user->has_question = 0;
+
+                LOG_EVENT(LOG_LEVEL_INFO,
+                          "question_deleted",
+                          LOG_INT("chat_id", ROOT_CHAT_ID),
+                          LOG_INT("target_chat_id", target_chat_id));
 
                 if (chat_id != target_chat_id)
-                    send_message_with_keyboard(target_chat_id,
-                                               EMOJI_OK " Ваш вопрос был решён\n\n"
-                                               "Если у вас остались ещё вопросы, не бойтесь задавать их снова!",
-                                               get_current_keyboard(target_chat_id));
-
-                send_message_with_keyboard(ROOT_CHAT_ID,
-                                           EMOJI_OK " Вопрос удалён",
-                                           get_current_keyboard(ROOT_CHAT_ID));
+                    send_reply(target_chat_id,
+                               REPLY_QUESTION_SOLVED,
+                               get_user_keyboard(&target_user));
+
+                send_reply(ROOT_CHAT_ID,
+                           REPLY_QUESTION_DELETED,
+                           get_user_keyboard(user));
             }
         }
     }
 }
+
+static void handle_faq_callback(const int_fast64_t chat_id,
+                                const cJSON *callback_query,
+                                const char *arg,
+                                const int reply)
+{
+    (void) callback_query;
+    (void) arg;
+
+    send_reply(chat_id, reply, KEYBOARD_NONE);
+}
+
+static void handle_list_prev_callback(const int_fast64_t chat_id,
+                                      const cJSON *callback_query,
+                                      const char *arg,
+                                      const int reply)
+{
+    (void) reply;
+
+    handle_list_callback(chat_id, callback_query, arg, 1);
+}
+
+static void handle_list_next_callback(const int_fast64_t chat_id,
+                                      const cJSON *callback_query,
+                                      const char *arg,
+                                      const int reply)
+{
+    (void) reply;
+
+    handle_list_callback(chat_id, callback_query, arg, 0);
+}
+
+static void handle_list_callback(const int_fast64_t chat_id,
+                                 const cJSON *callback_query,
+                                 const char *arg,
+                                 const int backwards)
+{
+    const cJSON *message = cJSON_GetObjectItem(callback_query, "message");
+
+    if (chat_id != ROOT_CHAT_ID || !message)
+        return;
+
+    char *end;
+    const int_fast64_t cursor = strtoll(arg, &end, 10);
+
+    if (*end || end == arg)
+        return;
+
+    send_questions_page(cJSON_GetNumberValue(cJSON_GetObjectItem(message, "message_id")),
+                        cursor,
+                        backwards);
+}
+
+// Sends a page of questions next to the cursor to the root chat, or edits
+// the message with the previous page if message_id is not 0.
+static void send_questions_page(const int_fast64_t message_id, const int_fast64_t cursor, const int backwards)
+{
+    int page_backwards = backwards;
+
+    cJSON *questions = backwards ?
+                       get_questions_before(cursor, MAX_QUESTIONS_PAGE_SIZE) :
+                       get_questions(cursor, MAX_QUESTIONS_PAGE_SIZE);
+
+    // All questions past the cursor may have been deleted meanwhile.
+    if (!cJSON_GetArraySize(questions) && cursor)
+    {
+        cJSON_Delete(questions);
+        questions = get_questions(0, MAX_QUESTIONS_PAGE_SIZE);
+        page_backwards = 0;
+    }
+
+    const int questions_size = cJSON_GetArraySize(questions);
+
+    if (!questions_size)
+    {
+        if (message_id)
+            edit_message_with_keyboard(ROOT_CHAT_ID,
+                                       message_id,
+                                       static_replies[REPLY_NO_QUESTIONS],
+                                       "{\"inline_keyboard\":[]}");
+        else
+            send_reply(ROOT_CHAT_ID,
+                       REPLY_NO_QUESTIONS,
+                       KEYBOARD_NONE);
+
+        cJSON_Delete(questions);
+        return;
+    }
+
+    char header[64];
+    snprintf(header,
+             sizeof header,
+             EMOJI_INFO " Открытых вопросов: %zu",
+             get_questions_count());
+
+    // The questions are packed from the cursor until the page is full,
+    // so the previous page ends right before the first question of this one.
+    size_t length = get_message_length(header);
+    size_t size = strlen(header) + 1;
+    int first = page_backwards ? questions_size : 0;
+    int last = first;
+
+    while (page_backwards ? first > 0 : last < questions_size)
+    {
+        const cJSON *question = cJSON_GetArrayItem(questions, page_backwards ? first - 1 : last);
+        const char *text = cJSON_GetStringValue(cJSON_GetObjectItem(question, "text"));
+
+        char prefix[MAX_CHAT_ID_SIZE + 8];
+        snprintf(prefix,
+                 sizeof prefix,
+                 "\n\n(%" PRId64 ") ",
+                 (int64_t) cJSON_GetNumberValue(cJSON_GetObjectItem(question, "chat_id")));
+
+        const size_t question_length = strlen(prefix) + get_message_length(text);
+
+        if (first != last && length + question_length > MAX_MESSAGE_LENGTH)
+            break;
+
+        length += question_length;
+        size += strlen(prefix) + strlen(text);
+
+        if (page_backwards)
+            --first;
+        else
+            ++last;
+    }
+
+    char *page = malloc(size);
+
+    if (!page)
+        die("%s: %s: failed to allocate memory for page",
+            __BASE_FILE__,
+            __func__);
+
+    char *end = page + sprintf(page, "%s", header);
+
+    for (int i = first; i < last; ++i)
+    {
+        const cJSON *question = cJSON_GetArrayItem(questions, i);
+
+        end += sprintf(end,
+                       "\n\n(%" PRId64 ") %s",
+                       (int64_t) cJSON_GetNumberValue(cJSON_GetObjectItem(question, "chat_id")),
+                       cJSON_GetStringValue(cJSON_GetObjectItem(question, "text")));
+    }
+
+    const int_fast64_t first_created = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetArrayItem(questions, first), "created"));
+    const int_fast64_t last_created = cJSON_GetNumberValue(cJSON_GetObjectItem(cJSON_GetArrayItem(questions, last - 1), "created"));
+
+    cJSON_Delete(questions);
+
+    cJSON *prev_questions = get_questions_before(first_created, 1);
+    cJSON *next_questions = get_questions(last_created, 1);
+
+    char prev_button[MAX_BUTTON_SIZE] = "";
+    char next_button[MAX_BUTTON_SIZE] = "";
+
+    if (cJSON_GetArraySize(prev_questions))
+        snprintf(prev_button,
+                 sizeof prev_button,
+                 "{\"text\":\"\U000025C0\",\"callback_data\":\"" CALLBACK_LIST_PREV "%" PRIdFAST64 "\"}",
+                 first_created);
+
+    if (cJSON_GetArraySize(next_questions))
+        snprintf(next_button,
+                 sizeof next_button,
+                 "{\"text\":\"\U000025B6\",\"callback_data\":\"" CALLBACK_LIST_NEXT "%" PRIdFAST64 "\"}",
+                 last_created);
+
+    cJSON_Delete(prev_questions);
+    cJSON_Delete(next_questions);
+
+    char keyboard[MAX_KEYBOARD_SIZE];
+
+    if (*prev_button || *next_button)
+        snprintf(keyboard,
+                 sizeof keyboard,
+                 "{\"inline_keyboard\":[[%s%s%s]]}",
+                 prev_button,
+                 *prev_button && *next_button ? "," : "",
+                 next_button);
+    else
+        snprintf(keyboard,
+                 sizeof keyboard,
+                 "{\"inline_keyboard\":[]}");
+
+    if (message_id)
+        edit_message_with_keyboard(ROOT_CHAT_ID, message_id, page, keyboard);
+    else
+        send_message_with_keyboard(ROOT_CHAT_ID, page, keyboard);
+
+    free(page);
+}
+
+// Counts the UTF-16 code units, which Telegram uses for the message length.
+static size_t get_message_length(const char *message)
+{
+    size_t length = 0;
+
+    for (const unsigned char *c = (const unsigned char *) message; *c; ++c)
+        if ((*c & 0xC0) != 0x80)
+            length += *c >= 0xF0 ? 2 : 1;
+
+    return length;
+}
+
+// Waits while too many batches are handled, which also bounds the updates
+// that are handled again after a crash.
+static PendingBatch *reserve_batch(const int_fast32_t next_update_id)
+{
+    pthread_mutex_lock(&pending_batches_mutex);
+
+    while (pending_batches_count == MAX_PENDING_BATCHES)
+        pthread_cond_wait(&pending_batches_cond, &pending_batches_mutex);
+
+    PendingBatch *batch = &pending_batches[(pending_batches_head + pending_batches_count) % MAX_PENDING_BATCHES];
+
+    batch->next_update_id = next_update_id;
+    batch->done = 0;
+
+    ++pending_batches_count;
+
+    pthread_mutex_unlock(&pending_batches_mutex);
+
+    return batch;
+}
+
+// Called when the arena of the batch is released by its last handler.
+static void commit_batch(void *pending_batch)
+{
+    PendingBatch *batch = pending_batch;
+
+    pthread_mutex_lock(&pending_batches_mutex);
+
+    batch->done = 1;
+
+    int_fast32_t next_update_id = 0;
+
+    while (pending_batches_count && pending_batches[pending_batches_head].done)
+    {
+        next_update_id = pending_batches[pending_batches_head].next_update_id;
+
+        pending_batches_head = (pending_batches_head + 1) % MAX_PENDING_BATCHES;
+        --pending_batches_count;
+    }
+
+    // The offsets are stored under the mutex, so they never go backwards.
+    if (next_update_id)
+    {
+        set_update_offset(next_update_id);
+        pthread_cond_signal(&pending_batches_cond);
+    }
+
+    pthread_mutex_unlock(&pending_batches_mutex);
+}
+
+// Waits until the handlers and the requests they queued are finished,
+// but no longer than SHUTDOWN_TIMEOUT_MS.
+static void drain_bot(void)
+{
+    WorkersStats workers_stats;
+    QueueStats queue_stats;
+
+    for (int waited = 0;; waited += DRAIN_POLL_INTERVAL_MS)
+    {
+        get_workers_stats(&workers_stats);
+        get_queue_stats(&queue_stats);
+
+        if (!workers_stats.busy_workers &&
+            !workers_stats.queued_works &&
+            !queue_stats.queued_requests &&
+            !queue_stats.active_requests)
+            return;
+
+        if (waited >= SHUTDOWN_TIMEOUT_MS)
+        {
+            report("Stopped with %" PRIuFAST64
+                   " unfinished works and %" PRIuFAST64
+                   " unsent requests",
+                   workers_stats.busy_workers + workers_stats.queued_works,
+                   queue_stats.queued_requests + queue_stats.active_requests);
+            return;
+        }
+
+        usleep(DRAIN_POLL_INTERVAL_MS * 1000);
+    }
+}
+
+static void init_routers(void)
+{
+    init_router(&command_router,
+                command_keys,
+                command_prefixes,
+                sizeof command_keys / sizeof *command_keys);
+    init_router(&callback_router,
+                callback_keys,
+                callback_prefixes,
+                sizeof callback_keys / sizeof *callback_keys);
+}
+
+static void init_replies(void)
+{
+    for (int i = 0; i < STATIC_REPLIES_COUNT; ++i)
+        encode_fields(&encoded_replies[i], "text", static_replies[i]);
+
+    for (int i = 0; i < KEYBOARDS_COUNT; ++i)
+        encode_fields(&encoded_keyboards[i], "reply_markup", keyboards[i]);
+}
+
+// Retries with the refreshed snapshot until the state is set, so the
+// other states changed meanwhile are kept.
+static void set_user_state(const int_fast64_t chat_id, UserSnapshot *user, const int state, const int state_value)
+{
+    uint32_t states;
+
+    do
+        states = state_value ?
+                 user->states | (uint32_t) 1 << state :
+                 user->states & ~((uint32_t) 1 << state);
+    while (!compare_and_set_states(chat_id, user, states) && user->exists);
+}
+
+static Keyboard get_user_keyboard(const UserSnapshot *user)
+{
+    if (user->has_question)
+        return KEYBOARD_QUESTION;
+
+    if ((user->states >> STATE_QUESTION_DESCRIPTION) & 1)
+        return KEYBOARD_CANCEL;
+
+    return KEYBOARD_DEFAULT;
+}
+
+static void send_reply(const int_fast64_t chat_id, const StaticReply reply, const Keyboard keyboard)
+{
+    send_encoded_message(chat_id, &encoded_replies[reply], &encoded_keyboards[keyboard]);
+}
+
+// Cuts the text to MAX_LOGGED_QUESTION_SIZE bytes on a UTF-8 character boundary.
+static int get_logged_size(const char *text)
+{
+    size_t size = strnlen(text, MAX_LOGGED_QUESTION_SIZE + 1);
+
+    if (size <= MAX_LOGGED_QUESTION_SIZE)
+        return size;
+
+    size = MAX_LOGGED_QUESTION_SIZE;
+
+    while (size && (text[size] & 0xC0) == 0x80)
+        --size;
+
+    return size;
+}
+
+static int_fast64_t get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int_fast64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
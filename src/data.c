@@ -1,236 +1,1569 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include <time.h>
 
 #include <cjson/cJSON.h>
 
 #include "log.h"
+#include "metrics.h"
+#include "trace.h"
 #include "data.h"
 
-static void load_users(void);
-static void save_users(void);
+// Open questions form a list in the creation order. Readers walk it in
+// both directions, an unlinked question keeps pointing to its neighbours.
+typedef struct Question
+{
+    int64_t chat_id;
+    int64_t created;
+    _Atomic(struct Question *) prev;
+    _Atomic(struct Question *) next;
+    char text[];
+}
+Question;
+
+// Telegram never uses 0 as a chat id, so it marks an empty slot.
+// A slot has the same layout in memory and in users.bin, where the
+// question is stored as an offset of its text from the file start.
+// The fields are atomic, because readers access them without locks.
+typedef struct
+{
+    _Atomic int64_t chat_id;
+    union
+    {
+        _Atomic(Question *) question;
+        uint64_t question_offset;
+    };
+    _Atomic uint32_t states;
+    uint32_t reserved;
+}
+User;
+
+// Readers find users in the published table, writers replace the table
+// when it grows and keep the old one until no reader can still use it.
+typedef struct
+{
+    User *users;
+    size_t capacity;
+}
+UsersTable;
 
-static cJSON *users_cache;
-static pthread_rwlock_t users_cache_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+// A pointer is freed only when every reader entered after its retirement.
+// A non-zero mapping_size means the pointer is unmapped instead.
+typedef struct
+{
+    void *pointer;
+    size_t mapping_size;
+    uint_fast64_t epoch;
+}
+RetiredPointer;
 
-void init_data_module(void)
+// users.bin is the header, capacity slots of the hash table,
+// questions_count questions in the creation order and their texts.
+typedef struct
 {
-    load_users();
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t questions_count;
+    uint64_t size;
+    int64_t update_offset;
+    uint64_t reserved;
 }
+UsersHeader;
 
-int has_user(const int_fast64_t chat_id)
+typedef struct
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    uint64_t slot;
+    int64_t created;
+}
+UsersQuestion;
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const int state = cJSON_GetObjectItem(users_cache, chat_id_string) ? 1 : 0;
-    pthread_rwlock_unlock(&users_cache_rwlock);
+_Static_assert(sizeof(User) == 24 && sizeof(Question *) == sizeof(uint64_t),
+               "users.bin slots must match the User layout");
 
-    return state;
+// Every change of a user is appended to the users log as one record
+// followed by payload_size bytes of payload.
+typedef struct
+{
+    int64_t chat_id;
+    int64_t value;
+    uint32_t payload_size;
+    uint32_t type;
+    uint32_t checksum;
+    uint32_t reserved;
 }
+LogRecord;
 
-void create_user(const int_fast64_t chat_id)
+// A copy of the users that is saved without holding users_mutex.
+typedef struct
+{
+    User *users;
+    size_t capacity;
+    UsersQuestion *questions;
+    char **texts;
+    size_t questions_count;
+    int64_t update_offset;
+}
+Snapshot;
+
+typedef struct
+{
+    int64_t chat_id;
+    int64_t created;
+    const char *text;
+}
+JsonQuestion;
+
+static const UsersTable *begin_read(void);
+static void end_read(void);
+static void publish_users(void);
+static void retire_pointer(void *pointer, const size_t mapping_size);
+static void reclaim_pointers(void);
+static User *find_user(User *slots, const size_t capacity, const int_fast64_t chat_id);
+static void fill_user_snapshot(const User *user, UserSnapshot *snapshot);
+static User *insert_user(const int_fast64_t chat_id);
+static void resize_users(const size_t capacity);
+static size_t hash_chat_id(const int_fast64_t chat_id);
+static Question *link_question(const int64_t chat_id,
+                               const int64_t created,
+                               const char *text,
+                               const size_t text_size);
+static void unlink_question(Question *question);
+static void add_question(cJSON *questions, const Question *question);
+static int compare_json_questions(const void *a, const void *b);
+static int64_t get_current_time(void);
+static int_fast64_t get_monotonic_time(void);
+static int load_data(void);
+static int load_users(void);
+static void load_users_json(const char *json_path);
+static void take_snapshot(Snapshot *snapshot);
+static void free_snapshot(Snapshot *snapshot);
+static void save_users(Snapshot *snapshot);
+static void save_users_json(const char *json_path);
+static void apply_record(const LogRecord *record, const char *payload);
+static uint_fast64_t append_record(const uint32_t type,
+                                   const int_fast64_t chat_id,
+                                   const int_fast64_t value,
+                                   const char *payload);
+static void wait_for_record(const uint_fast64_t record_sequence);
+static void lock_users(void);
+static void replay_log(const char *log_path);
+static void open_log(void);
+static void *flush_users_log(void *arg);
+static void write_records(void);
+static void compact_users(void);
+static uint32_t get_checksum(const LogRecord *record, const char *payload);
+
+static const char *state_names[STATES_COUNT] =
+{
+    "question_description_state"
+};
+
+// Open addressing with linear probing, the capacity is a power of two.
+// Only writers holding users_mutex use these directly.
+static User *users = NULL;
+static size_t users_capacity = 0;
+static size_t users_count = 0;
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Not NULL while the slots are used in place from the mapped users.bin.
+static void *users_mapping = NULL;
+static size_t users_mapping_size = 0;
+
+// Creation times are unique, so a question is identified by its time.
+static _Atomic(Question *) questions_head = NULL;
+static _Atomic(Question *) questions_tail = NULL;
+static atomic_size_t questions_count = 0;
+static int64_t last_question_created = 0;
+
+// The getUpdates offset of the first update that is not handled yet.
+static int64_t update_offset = 0;
+
+// Every reader thread publishes the epoch it entered in, 0 when it is idle.
+static _Atomic(UsersTable *) users_table = NULL;
+static atomic_uint_fast64_t users_epoch = 1;
+static atomic_uint_fast64_t reader_epochs[MAX_USERS_READERS];
+static atomic_size_t readers_count = 0;
+static _Thread_local atomic_uint_fast64_t *reader_epoch = NULL;
+
+static RetiredPointer *retired_pointers = NULL;
+static size_t retired_pointers_count = 0;
+static size_t retired_pointers_capacity = 0;
+
+// The flusher thread writes the users log, close_data_module() writes
+// the rest of the records on shutdown.
+static int users_log_fd;
+static size_t users_log_size = 0;
+static pthread_mutex_t users_log_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t compaction_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int durability = DURABILITY_INTERVAL;
+static int flush_interval = DEFAULT_FLUSH_INTERVAL_MS;
+
+// Writers only put records into the dirty buffer, the flusher thread
+// commits all of them with one write and one fsync.
+static char *dirty_records = NULL;
+static size_t dirty_records_size = 0;
+static size_t dirty_records_capacity = 0;
+static size_t dirty_records_count = 0;
+static struct timespec first_dirty_time;
+static uint_fast64_t appended_sequence = 0;
+static uint_fast64_t durable_sequence = 0;
+static pthread_mutex_t users_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dirty_records_cond;
+static pthread_cond_t durable_records_cond = PTHREAD_COND_INITIALIZER;
+
+void init_data_module(const int durability_policy, const int flush_interval_ms)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    durability = durability_policy;
+    flush_interval = flush_interval_ms;
 
-    cJSON *user = cJSON_CreateObject();
-    cJSON_AddNumberToObject(user, "question_description_state", 0);
+    if (load_data())
+    {
+        Snapshot snapshot;
+        take_snapshot(&snapshot);
+        save_users(&snapshot);
+        free_snapshot(&snapshot);
+
+        if ((unlink(FILE_USERS_OLD_LOG) && errno != ENOENT) ||
+            (truncate(FILE_USERS_LOG, 0) && errno != ENOENT))
+            die("%s: %s: failed to clean up %s",
+                __BASE_FILE__,
+                __func__,
+                DIR_USERS);
+
+        users_log_size = 0;
+    }
+
+    open_log();
+
+    pthread_condattr_t dirty_records_condattr;
+    pthread_condattr_init(&dirty_records_condattr);
+    pthread_condattr_setclock(&dirty_records_condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&dirty_records_cond, &dirty_records_condattr);
+    pthread_condattr_destroy(&dirty_records_condattr);
+
+    pthread_t flush_users_log_thread;
+
+    if (pthread_create(&flush_users_log_thread,
+                       NULL,
+                       flush_users_log,
+                       NULL))
+        die("%s: %s: failed to create flush_users_log_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(flush_users_log_thread);
+}
+
+// Writes the remaining changes and keeps the users locked, so the data
+// module must not be used afterwards.
+void close_data_module(void)
+{
+    pthread_mutex_lock(&compaction_mutex);
+    lock_users();
+
+    write_records();
+}
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+size_t import_users(const char *json_path)
+{
+    resize_users(MIN_USERS_CAPACITY);
+    load_users_json(json_path);
+
+    Snapshot snapshot;
+    take_snapshot(&snapshot);
+    save_users(&snapshot);
+    free_snapshot(&snapshot);
+
+    // The imported users replace everything, including the logged changes.
+    if ((unlink(FILE_USERS_OLD_LOG) && errno != ENOENT) ||
+        (unlink(FILE_USERS_LOG) && errno != ENOENT))
+        die("%s: %s: failed to clean up %s",
+            __BASE_FILE__,
+            __func__,
+            DIR_USERS);
+
+    return users_count;
+}
 
-    cJSON_AddItemToObject(users_cache, chat_id_string, user);
-    save_users();
+size_t export_users(const char *json_path)
+{
+    load_data();
+    save_users_json(json_path);
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    return users_count;
 }
 
-int get_state(const int_fast64_t chat_id, const char *state_name)
+int get_user_snapshot(const int_fast64_t chat_id, UserSnapshot *snapshot)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int_fast64_t span_start = begin_span();
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const cJSON *state = cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), state_name);
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    const UsersTable *table = begin_read();
+    fill_user_snapshot(find_user(table->users, table->capacity, chat_id), snapshot);
+    end_read();
 
-    return state->valueint;
+    end_span("get_user_snapshot", span_start);
+    return snapshot->exists;
 }
 
-void set_state(const int_fast64_t chat_id, const char *state_name, const int state_value)
+void create_user(const int_fast64_t chat_id)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int_fast64_t span_start = begin_span();
+
+    lock_users();
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+    insert_user(chat_id);
+    const uint_fast64_t record_sequence = append_record(RECORD_CREATE_USER, chat_id, 0, NULL);
 
-    cJSON_SetIntValue(cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), state_name), state_value);
-    save_users();
+    pthread_mutex_unlock(&users_mutex);
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    wait_for_record(record_sequence);
+    end_span("create_user", span_start);
 }
 
-int has_question(const int_fast64_t chat_id)
+// Sets the states only if they are still the ones in the snapshot,
+// the snapshot is refreshed either way, so a failed caller can retry.
+int compare_and_set_states(const int_fast64_t chat_id, UserSnapshot *snapshot, const uint32_t states)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int_fast64_t span_start = begin_span();
+    uint_fast64_t record_sequence = 0;
+    int result = 0;
+
+    lock_users();
+
+    User *user = find_user(users, users_capacity, chat_id);
+
+    if (user && user->states == snapshot->states)
+    {
+        if (states != snapshot->states)
+        {
+            user->states = states;
+            record_sequence = append_record(RECORD_SET_STATES, chat_id, states, NULL);
+        }
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    const int state = cJSON_GetObjectItem(cJSON_GetObjectItem(users_cache, chat_id_string), "question") ? 1 : 0;
-    pthread_rwlock_unlock(&users_cache_rwlock);
+        result = 1;
+    }
+
+    fill_user_snapshot(user, snapshot);
+
+    pthread_mutex_unlock(&users_mutex);
+
+    wait_for_record(record_sequence);
+    end_span("compare_and_set_states", span_start);
 
-    return state;
+    return result;
 }
 
 void create_question(const int_fast64_t chat_id, const char *question_text)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int_fast64_t span_start = begin_span();
+    uint_fast64_t record_sequence = 0;
 
-    cJSON *question = cJSON_CreateObject();
+    lock_users();
 
-    cJSON_AddStringToObject(question, "text", question_text);
+    User *user = find_user(users, users_capacity, chat_id);
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+    if (user)
+    {
+        if (user->question)
+            unlink_question(user->question);
+
+        Question *question = link_question(chat_id,
+                                           get_current_time(),
+                                           question_text,
+                                           strlen(question_text));
+        user->question = question;
+
+        record_sequence = append_record(RECORD_CREATE_QUESTION, chat_id, question->created, question->text);
+    }
 
-    cJSON_AddItemToObject(cJSON_GetObjectItem(users_cache, chat_id_string), "question", question);
-    save_users();
+    pthread_mutex_unlock(&users_mutex);
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    wait_for_record(record_sequence);
+    end_span("create_question", span_start);
 }
 
-void delete_question(const int_fast64_t chat_id)
+// Returns 0 if the user has no question to delete.
+int delete_question(const int_fast64_t chat_id)
 {
-    char chat_id_string[MAX_CHAT_ID_SIZE + 1];
-    snprintf(chat_id_string,
-             sizeof chat_id_string,
-             "%" PRIdFAST64,
-             chat_id);
+    const int_fast64_t span_start = begin_span();
+    uint_fast64_t record_sequence = 0;
+    int result = 0;
 
-    pthread_rwlock_wrlock(&users_cache_rwlock);
+    lock_users();
 
-    cJSON_DeleteItemFromObject(cJSON_GetObjectItem(users_cache, chat_id_string), "question");
-    save_users();
+    User *user = find_user(users, users_capacity, chat_id);
+
+    if (user && user->question)
+    {
+        unlink_question(user->question);
+        user->question = NULL;
+
+        record_sequence = append_record(RECORD_DELETE_QUESTION, chat_id, 0, NULL);
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+
+    wait_for_record(record_sequence);
+    end_span("delete_question", span_start);
+
+    return result;
+}
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+size_t get_questions_count(void)
+{
+    return atomic_load(&questions_count);
 }
 
-cJSON *get_questions(void)
+cJSON *get_questions(const int_fast64_t cursor, const size_t limit)
 {
+    const int_fast64_t span_start = begin_span();
     cJSON *questions = cJSON_CreateArray();
 
-    pthread_rwlock_rdlock(&users_cache_rwlock);
-    cJSON *user = users_cache->child;
+    begin_read();
 
-    while (user)
-    {
-        const cJSON *question = cJSON_GetObjectItem(user, "question");
+    const Question *question = atomic_load(&questions_head);
 
-        if (question)
-        {
-            cJSON *text = cJSON_GetObjectItem(question, "text");
+    while (question && question->created <= cursor)
+        question = question->next;
 
-            char chat_id_with_question[MAX_CHAT_ID_SIZE + MAX_USERNAME_SIZE + MAX_QUESTION_SIZE + 7];
-            snprintf(chat_id_with_question,
-                     sizeof chat_id_with_question,
-                     "(%s) %s",
-                     user->string,
-                     text->valuestring);
+    for (size_t i = 0; question && i < limit; ++i, question = question->next)
+        add_question(questions, question);
 
-            cJSON_AddItemToArray(questions, cJSON_CreateString(chat_id_with_question));
-        }
+    end_read();
 
-        user = user->next;
-    }
+    end_span("get_questions", span_start);
+    return questions;
+}
+
+cJSON *get_questions_before(const int_fast64_t cursor, const size_t limit)
+{
+    const int_fast64_t span_start = begin_span();
+    cJSON *questions = cJSON_CreateArray();
+
+    begin_read();
+
+    const Question *question = atomic_load(&questions_tail);
+
+    while (question && cursor && question->created >= cursor)
+        question = question->prev;
+
+    // Step back to the first question of the page, then list it forwards.
+    for (size_t i = 1; question && question->prev && i < limit; ++i)
+        question = question->prev;
+
+    for (size_t i = 0;
+         question && i < limit && (!cursor || question->created < cursor);
+         ++i, question = question->next)
+        add_question(questions, question);
 
-    pthread_rwlock_unlock(&users_cache_rwlock);
+    end_read();
+
+    end_span("get_questions_before", span_start);
     return questions;
 }
 
-static void load_users(void)
+int_fast64_t get_update_offset(void)
 {
-    FILE *users_file = fopen(FILE_USERS, "r");
+    lock_users();
+    const int_fast64_t offset = update_offset;
+    pthread_mutex_unlock(&users_mutex);
 
-    if (!users_file)
-        die("%s: %s: failed to open %s",
-            __BASE_FILE__,
-            __func__,
-            FILE_USERS);
+    return offset;
+}
 
-    fseek(users_file, 0, SEEK_END);
-    const size_t users_file_size = ftell(users_file);
-    rewind(users_file);
+// The offset is not waited for, a lost one only makes some updates
+// be handled again.
+void set_update_offset(const int_fast64_t offset)
+{
+    const int_fast64_t span_start = begin_span();
 
-    char *users_string = malloc(users_file_size + 1);
+    lock_users();
 
-    if (!users_string)
-        die("%s: %s: failed to allocate memory for users_string",
+    if (offset != update_offset)
+    {
+        update_offset = offset;
+        append_record(RECORD_UPDATE_OFFSET, 0, offset, NULL);
+    }
+
+    pthread_mutex_unlock(&users_mutex);
+
+    end_span("set_update_offset", span_start);
+}
+
+static const UsersTable *begin_read(void)
+{
+    if (!reader_epoch)
+    {
+        const size_t reader = atomic_fetch_add(&readers_count, 1);
+
+        if (reader >= MAX_USERS_READERS)
+            die("%s: %s: too many threads read users",
+                __BASE_FILE__,
+                __func__);
+
+        reader_epoch = &reader_epochs[reader];
+    }
+
+    // The epoch is published before the table is loaded, so a writer that
+    // retires the table afterwards sees that this reader may still use it.
+    atomic_store(reader_epoch, atomic_load(&users_epoch));
+    return atomic_load(&users_table);
+}
+
+static void end_read(void)
+{
+    atomic_store_explicit(reader_epoch, 0, memory_order_release);
+}
+
+static void publish_users(void)
+{
+    UsersTable *table = malloc(sizeof *table);
+
+    if (!table)
+        die("%s: %s: failed to allocate memory for table",
             __BASE_FILE__,
             __func__);
 
-    if (fread(users_string,
-              1,
-              users_file_size,
-              users_file) != users_file_size)
-        die("%s: %s: failed to read data from %s",
-            __BASE_FILE__,
-            __func__,
-            FILE_USERS);
+    table->users = users;
+    table->capacity = users_capacity;
 
-    fclose(users_file);
+    retire_pointer(atomic_exchange(&users_table, table), 0);
+}
 
-    users_string[users_file_size] = 0;
-    cJSON *users = cJSON_Parse(users_string);
+static void retire_pointer(void *pointer, const size_t mapping_size)
+{
+    if (!pointer)
+        return;
 
-    if (!users)
-        die("%s: %s: failed to parse users_string",
+    if (retired_pointers_count == retired_pointers_capacity)
+    {
+        retired_pointers_capacity = retired_pointers_capacity ? retired_pointers_capacity * 2 : MAX_RETIRED_POINTERS;
+
+        if (!(retired_pointers = realloc(retired_pointers, retired_pointers_capacity * sizeof *retired_pointers)))
+            die("%s: %s: failed to reallocate memory for retired_pointers",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    RetiredPointer *retired_pointer = &retired_pointers[retired_pointers_count++];
+
+    retired_pointer->pointer = pointer;
+    retired_pointer->mapping_size = mapping_size;
+    retired_pointer->epoch = atomic_fetch_add(&users_epoch, 1);
+
+    if (retired_pointers_count >= MAX_RETIRED_POINTERS)
+        reclaim_pointers();
+}
+
+static void reclaim_pointers(void)
+{
+    uint_fast64_t min_epoch = UINT_FAST64_MAX;
+    size_t readers = atomic_load(&readers_count);
+
+    if (readers > MAX_USERS_READERS)
+        readers = MAX_USERS_READERS;
+
+    for (size_t i = 0; i < readers; ++i)
+    {
+        const uint_fast64_t epoch = atomic_load(&reader_epochs[i]);
+
+        if (epoch && epoch < min_epoch)
+            min_epoch = epoch;
+    }
+
+    size_t kept_count = 0;
+
+    for (size_t i = 0; i < retired_pointers_count; ++i)
+    {
+        RetiredPointer *retired_pointer = &retired_pointers[i];
+
+        if (retired_pointer->epoch >= min_epoch)
+            retired_pointers[kept_count++] = *retired_pointer;
+        else if (retired_pointer->mapping_size)
+            munmap(retired_pointer->pointer, retired_pointer->mapping_size);
+        else
+            free(retired_pointer->pointer);
+    }
+
+    retired_pointers_count = kept_count;
+}
+
+static User *find_user(User *slots, const size_t capacity, const int_fast64_t chat_id)
+{
+    if (!chat_id)
+        return NULL;
+
+    for (size_t i = hash_chat_id(chat_id) & (capacity - 1);; i = (i + 1) & (capacity - 1))
+    {
+        User *user = &slots[i];
+        const int64_t slot_chat_id = user->chat_id;
+
+        if (slot_chat_id == chat_id)
+            return user;
+
+        if (!slot_chat_id)
+            return NULL;
+    }
+}
+
+static void fill_user_snapshot(const User *user, UserSnapshot *snapshot)
+{
+    snapshot->exists = user ? 1 : 0;
+    snapshot->states = user ? user->states : 0;
+    snapshot->has_question = user && user->question ? 1 : 0;
+}
+
+static User *insert_user(const int_fast64_t chat_id)
+{
+    User *user = find_user(users, users_capacity, chat_id);
+
+    if (user)
+        return user;
+
+    // Keep the load factor under 0.75, users are never removed.
+    if ((users_count + 1) * 4 > users_capacity * 3)
+        resize_users(users_capacity * 2);
+
+    size_t i = hash_chat_id(chat_id) & (users_capacity - 1);
+
+    while (users[i].chat_id)
+        i = (i + 1) & (users_capacity - 1);
+
+    // The chat id is stored last, it makes the slot visible to readers.
+    user = &users[i];
+    user->states = 0;
+    user->question = NULL;
+    user->chat_id = chat_id;
+
+    ++users_count;
+    return user;
+}
+
+static void resize_users(const size_t capacity)
+{
+    User *new_users = calloc(capacity, sizeof *new_users);
+
+    if (!new_users)
+        die("%s: %s: failed to allocate memory for new_users",
             __BASE_FILE__,
             __func__);
 
-    free(users_string);
-    users_cache = users;
+    for (size_t i = 0; i < users_capacity; ++i)
+    {
+        if (!users[i].chat_id)
+            continue;
+
+        size_t j = hash_chat_id(users[i].chat_id) & (capacity - 1);
+
+        while (new_users[j].chat_id)
+            j = (j + 1) & (capacity - 1);
+
+        new_users[j] = users[i];
+    }
+
+    if (users_mapping)
+    {
+        retire_pointer(users_mapping, users_mapping_size);
+        users_mapping = NULL;
+    }
+    else
+        retire_pointer(users, 0);
+
+    users = new_users;
+    users_capacity = capacity;
+
+    publish_users();
 }
 
-static void save_users(void)
+static size_t hash_chat_id(const int_fast64_t chat_id)
 {
-    char *users_string = cJSON_PrintUnformatted(users_cache);
+    uint64_t hash = chat_id;
 
-    if (!users_string)
-        die("%s: %s: failed to print users_cache",
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCD;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static Question *link_question(const int64_t chat_id,
+                               const int64_t created,
+                               const char *text,
+                               const size_t text_size)
+{
+    Question *question = malloc(sizeof *question + text_size + 1);
+
+    if (!question)
+        die("%s: %s: failed to allocate memory for question",
             __BASE_FILE__,
             __func__);
 
-    FILE *users_file = fopen(FILE_USERS, "w");
+    question->chat_id = chat_id;
+    question->created = created > last_question_created ? created : last_question_created + 1;
+    question->prev = questions_tail;
+    question->next = NULL;
+
+    memcpy(question->text, text, text_size);
+    question->text[text_size] = 0;
+
+    last_question_created = question->created;
+
+    // The question is complete before it is reachable by readers.
+    if (questions_tail)
+        questions_tail->next = question;
+    else
+        questions_head = question;
+
+    questions_tail = question;
+    ++questions_count;
+
+    return question;
+}
+
+static void unlink_question(Question *question)
+{
+    Question *next = question->next;
+
+    // Readers standing on the question still reach the rest of the list.
+    if (question->prev)
+        question->prev->next = next;
+    else
+        questions_head = next;
+
+    if (next)
+        next->prev = question->prev;
+    else
+        questions_tail = question->prev;
+
+    --questions_count;
+    retire_pointer(question, 0);
+}
+
+static void add_question(cJSON *questions, const Question *question)
+{
+    cJSON *question_json = cJSON_CreateObject();
+
+    cJSON_AddNumberToObject(question_json, "chat_id", question->chat_id);
+    cJSON_AddNumberToObject(question_json, "created", question->created);
+    cJSON_AddStringToObject(question_json, "text", question->text);
+
+    cJSON_AddItemToArray(questions, question_json);
+}
+
+static int compare_json_questions(const void *a, const void *b)
+{
+    const int64_t a_created = ((const JsonQuestion *) a)->created;
+    const int64_t b_created = ((const JsonQuestion *) b)->created;
+
+    return (a_created > b_created) - (a_created < b_created);
+}
+
+static int64_t get_current_time(void)
+{
+    struct timespec current_time;
+    clock_gettime(CLOCK_REALTIME, &current_time);
+
+    return (int64_t) current_time.tv_sec * 1000000 + current_time.tv_nsec / 1000;
+}
+
+static int_fast64_t get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int_fast64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+// Loads the users and the logged changes, returns 1 if users.bin has to
+// be rewritten before new changes are logged.
+static int load_data(void)
+{
+    int rewrite = 0;
+
+    if (!load_users())
+    {
+        resize_users(MIN_USERS_CAPACITY);
+
+        // users.json is the snapshot format of the older versions.
+        if (!access(FILE_USERS_JSON, F_OK))
+        {
+            load_users_json(FILE_USERS_JSON);
+
+            report("Migrated %zu users from %s to %s",
+                   users_count,
+                   FILE_USERS_JSON,
+                   FILE_USERS);
+        }
+
+        rewrite = 1;
+    }
+
+    // The old log is left only if the last compaction did not finish.
+    if (!access(FILE_USERS_OLD_LOG, F_OK))
+    {
+        replay_log(FILE_USERS_OLD_LOG);
+        rewrite = 1;
+    }
+
+    replay_log(FILE_USERS_LOG);
+
+    return rewrite;
+}
+
+static int load_users(void)
+{
+    const int users_fd = open(FILE_USERS, O_RDONLY | O_CLOEXEC);
+
+    if (users_fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
 
-    if (!users_file)
         die("%s: %s: failed to open %s",
             __BASE_FILE__,
             __func__,
             FILE_USERS);
+    }
 
-    fprintf(users_file, "%s", users_string);
+    struct stat users_stat;
 
-    fclose(users_file);
+    if (fstat(users_fd, &users_stat))
+        die("%s: %s: failed to stat %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    const size_t size = users_stat.st_size;
+
+    if (size < sizeof(UsersHeader))
+        die("%s: %s: %s is truncated",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    // The private mapping is copy-on-write, so the slots are changed in place
+    // while the file stays intact until the next snapshot replaces it.
+    char *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, users_fd, 0);
+
+    if (mapping == MAP_FAILED)
+        die("%s: %s: failed to map %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    close(users_fd);
+
+    UsersHeader header;
+    memcpy(&header, mapping, sizeof header);
+
+    if (memcmp(header.magic, USERS_MAGIC, sizeof header.magic) ||
+        header.version != USERS_VERSION ||
+        header.slot_size != sizeof(User) ||
+        header.size != size ||
+        header.capacity < MIN_USERS_CAPACITY ||
+        header.capacity & (header.capacity - 1) ||
+        header.capacity > (size - sizeof header) / sizeof(User) ||
+        header.count * 4 > header.capacity * 3 ||
+        header.questions_count > header.count ||
+        header.questions_count > (size - sizeof header - header.capacity * sizeof(User)) / sizeof(UsersQuestion))
+        die("%s: %s: %s has an unsupported format",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS);
+
+    const size_t slots_size = header.capacity * sizeof(User);
+    const size_t strings_offset = sizeof header + slots_size + header.questions_count * sizeof(UsersQuestion);
+
+    users = (User *) (mapping + sizeof header);
+    users_capacity = header.capacity;
+    users_count = header.count;
+    update_offset = header.update_offset;
+    users_mapping = mapping;
+    users_mapping_size = size;
+
+    publish_users();
+
+    const char *questions = mapping + sizeof header + slots_size;
+
+    // Every slot with a question offset has to be listed exactly once,
+    // otherwise a raw offset would be left in place of a pointer.
+    unsigned char *listed_slots = calloc(users_capacity, 1);
+
+    if (!listed_slots)
+        die("%s: %s: failed to allocate memory for listed_slots",
+            __BASE_FILE__,
+            __func__);
+
+    for (size_t i = 0; i < header.questions_count; ++i)
+    {
+        UsersQuestion question;
+        memcpy(&question, questions + i * sizeof question, sizeof question);
+
+        if (question.slot >= users_capacity || listed_slots[question.slot])
+            die("%s: %s: %s has an invalid question",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS);
+
+        listed_slots[question.slot] = 1;
+    }
+
+    for (size_t i = 0; i < users_capacity; ++i)
+        if (!listed_slots[i] && users[i].question_offset)
+            die("%s: %s: %s has an invalid question",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS);
+
+    free(listed_slots);
+
+    // Only the slots with questions are touched, their offsets become
+    // pointers to the questions linked in the saved order.
+    for (size_t i = 0; i < header.questions_count; ++i)
+    {
+        UsersQuestion question;
+        memcpy(&question, questions + i * sizeof question, sizeof question);
+
+        User *user = &users[question.slot];
+
+        if (!user->chat_id ||
+            user->question_offset < strings_offset ||
+            user->question_offset >= size ||
+            !memchr(mapping + user->question_offset, 0, size - user->question_offset))
+            die("%s: %s: %s has an invalid question",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS);
+
+        const char *text = mapping + user->question_offset;
+        user->question = link_question(user->chat_id, question.created, text, strlen(text));
+    }
+
+    return 1;
+}
+
+static void load_users_json(const char *json_path)
+{
+    FILE *users_file = fopen(json_path, "r");
+
+    if (!users_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            json_path);
+
+    fseek(users_file, 0, SEEK_END);
+    const size_t users_file_size = ftell(users_file);
+    rewind(users_file);
+
+    char *users_string = malloc(users_file_size + 1);
+
+    if (!users_string)
+        die("%s: %s: failed to allocate memory for users_string",
+            __BASE_FILE__,
+            __func__);
+
+    if (fread(users_string,
+              1,
+              users_file_size,
+              users_file) != users_file_size)
+        die("%s: %s: failed to read data from %s",
+            __BASE_FILE__,
+            __func__,
+            json_path);
+
+    fclose(users_file);
+
+    users_string[users_file_size] = 0;
+    cJSON *users_json = cJSON_Parse(users_string);
+
+    if (!users_json)
+        die("%s: %s: failed to parse users_string",
+            __BASE_FILE__,
+            __func__);
+
+    free(users_string);
+
+    const int users_json_size = cJSON_GetArraySize(users_json);
+
+    JsonQuestion *questions = malloc((users_json_size + 1) * sizeof *questions);
+    size_t questions_size = 0;
+
+    if (!questions)
+        die("%s: %s: failed to allocate memory for questions",
+            __BASE_FILE__,
+            __func__);
+
+    for (const cJSON *user_json = users_json->child; user_json; user_json = user_json->next)
+    {
+        char *end;
+        const int_fast64_t chat_id = strtoll(user_json->string, &end, 10);
+
+        if (*end || end == user_json->string || !chat_id)
+            die("%s: %s: invalid chat id '%s' in %s",
+                __BASE_FILE__,
+                __func__,
+                user_json->string,
+                json_path);
+
+        User *user = insert_user(chat_id);
+
+        for (int state = 0; state < STATES_COUNT; ++state)
+            if (cJSON_GetNumberValue(cJSON_GetObjectItem(user_json, state_names[state])) == 1)
+                user->states |= (uint_fast32_t) 1 << state;
+
+        const cJSON *question_json = cJSON_GetObjectItem(user_json, "question");
+        const char *text = cJSON_GetStringValue(cJSON_GetObjectItem(question_json, "text"));
+
+        if (text)
+        {
+            questions[questions_size].chat_id = chat_id;
+            questions[questions_size].created = cJSON_GetNumberValue(cJSON_GetObjectItem(question_json, "created"));
+            questions[questions_size].text = text;
+            ++questions_size;
+        }
+    }
+
+    // Questions are linked in the creation order, whatever the users order is.
+    qsort(questions, questions_size, sizeof *questions, compare_json_questions);
+
+    for (size_t i = 0; i < questions_size; ++i)
+    {
+        User *user = find_user(users, users_capacity, questions[i].chat_id);
+
+        if (user->question)
+            unlink_question(user->question);
+
+        user->question = link_question(questions[i].chat_id,
+                                       questions[i].created,
+                                       questions[i].text,
+                                       strlen(questions[i].text));
+    }
+
+    free(questions);
+    cJSON_Delete(users_json);
+}
+
+static void take_snapshot(Snapshot *snapshot)
+{
+    snapshot->capacity = users_capacity;
+    snapshot->questions_count = questions_count;
+    snapshot->update_offset = update_offset;
+
+    if (!(snapshot->users = malloc(users_capacity * sizeof *snapshot->users)) ||
+        !(snapshot->questions = malloc((questions_count + 1) * sizeof *snapshot->questions)) ||
+        !(snapshot->texts = malloc((questions_count + 1) * sizeof *snapshot->texts)))
+        die("%s: %s: failed to allocate memory for snapshot",
+            __BASE_FILE__,
+            __func__);
+
+    memcpy(snapshot->users, users, users_capacity * sizeof *users);
+
+    for (size_t i = 0; i < users_capacity; ++i)
+        snapshot->users[i].question_offset = 0;
+
+    size_t i = 0;
+
+    for (const Question *question = questions_head; question; question = question->next, ++i)
+    {
+        snapshot->questions[i].slot = find_user(users, users_capacity, question->chat_id) - users;
+        snapshot->questions[i].created = question->created;
+
+        if (!(snapshot->texts[i] = strdup(question->text)))
+            die("%s: %s: failed to allocate memory for snapshot->texts[i]",
+                __BASE_FILE__,
+                __func__);
+    }
+}
+
+static void free_snapshot(Snapshot *snapshot)
+{
+    for (size_t i = 0; i < snapshot->questions_count; ++i)
+        free(snapshot->texts[i]);
+
+    free(snapshot->texts);
+    free(snapshot->questions);
+    free(snapshot->users);
+}
+
+static void save_users(Snapshot *snapshot)
+{
+    const int_fast64_t save_time = get_monotonic_time();
+
+    UsersHeader header;
+    memset(&header, 0, sizeof header);
+
+    memcpy(header.magic, USERS_MAGIC, sizeof header.magic);
+    header.version = USERS_VERSION;
+    header.slot_size = sizeof(User);
+    header.capacity = snapshot->capacity;
+    header.questions_count = snapshot->questions_count;
+    header.update_offset = snapshot->update_offset;
+
+    for (size_t i = 0; i < snapshot->capacity; ++i)
+        if (snapshot->users[i].chat_id)
+            ++header.count;
+
+    size_t question_offset = sizeof header +
+                             snapshot->capacity * sizeof(User) +
+                             snapshot->questions_count * sizeof(UsersQuestion);
+
+    for (size_t i = 0; i < snapshot->questions_count; ++i)
+    {
+        snapshot->users[snapshot->questions[i].slot].question_offset = question_offset;
+        question_offset += strlen(snapshot->texts[i]) + 1;
+    }
+
+    header.size = question_offset;
+
+    // The snapshot replaces the old one only when it is completely on disk.
+    FILE *users_file = fopen(FILE_USERS_TMP, "w");
+
+    if (!users_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_TMP);
+
+    fwrite(&header, sizeof header, 1, users_file);
+    fwrite(snapshot->users, sizeof(User), snapshot->capacity, users_file);
+    fwrite(snapshot->questions, sizeof(UsersQuestion), snapshot->questions_count, users_file);
+
+    for (size_t i = 0; i < snapshot->questions_count; ++i)
+        fwrite(snapshot->texts[i], strlen(snapshot->texts[i]) + 1, 1, users_file);
+
+    if (ferror(users_file) || fflush(users_file) || fsync(fileno(users_file)))
+        die("%s: %s: failed to write %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_TMP);
+
+    fclose(users_file);
+
+    if (rename(FILE_USERS_TMP, FILE_USERS))
+        die("%s: %s: failed to rename %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_TMP);
+
+    const int users_dir_fd = open(DIR_USERS, O_RDONLY | O_DIRECTORY);
+
+    if (users_dir_fd >= 0)
+    {
+        fsync(users_dir_fd);
+        close(users_dir_fd);
+    }
+
+    record_histogram(HISTOGRAM_SAVE_USERS_TIME, get_monotonic_time() - save_time);
+    record_histogram(HISTOGRAM_SAVE_USERS_SIZE, header.size);
+    add_counter(COUNTER_SAVED_USERS_BYTES, header.size);
+}
+
+static void save_users_json(const char *json_path)
+{
+    cJSON *users_json = cJSON_CreateObject();
+
+    for (size_t i = 0; i < users_capacity; ++i)
+    {
+        const User *user = &users[i];
+
+        if (!user->chat_id)
+            continue;
+
+        char chat_id_string[MAX_CHAT_ID_SIZE + 1];
+        snprintf(chat_id_string,
+                 sizeof chat_id_string,
+                 "%" PRId64,
+                 user->chat_id);
+
+        cJSON *user_json = cJSON_CreateObject();
+
+        for (int state = 0; state < STATES_COUNT; ++state)
+            cJSON_AddNumberToObject(user_json, state_names[state], (user->states >> state) & 1);
+
+        const Question *question = user->question;
+
+        if (question)
+        {
+            cJSON *question_json = cJSON_AddObjectToObject(user_json, "question");
+
+            cJSON_AddStringToObject(question_json, "text", question->text);
+            cJSON_AddNumberToObject(question_json, "created", question->created);
+        }
+
+        cJSON_AddItemToObject(users_json, chat_id_string, user_json);
+    }
+
+    char *users_string = cJSON_PrintUnformatted(users_json);
+
+    if (!users_string)
+        die("%s: %s: failed to print users_json",
+            __BASE_FILE__,
+            __func__);
+
+    cJSON_Delete(users_json);
+
+    FILE *users_file = fopen(json_path, "w");
+
+    if (!users_file)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            json_path);
+
+    fprintf(users_file, "%s", users_string);
+
+    if (fflush(users_file))
+        die("%s: %s: failed to write %s",
+            __BASE_FILE__,
+            __func__,
+            json_path);
+
+    fclose(users_file);
     free(users_string);
 }
+
+static void apply_record(const LogRecord *record, const char *payload)
+{
+    if (record->type == RECORD_UPDATE_OFFSET)
+    {
+        update_offset = record->value;
+        return;
+    }
+
+    User *user = insert_user(record->chat_id);
+
+    switch (record->type)
+    {
+        case RECORD_SET_STATES:
+            user->states = record->value;
+            break;
+
+        case RECORD_CREATE_QUESTION:
+            if (user->question)
+                unlink_question(user->question);
+
+            user->question = link_question(record->chat_id, record->value, payload, record->payload_size);
+            break;
+
+        case RECORD_DELETE_QUESTION:
+            if (user->question)
+                unlink_question(user->question);
+
+            user->question = NULL;
+            break;
+    }
+}
+
+static uint_fast64_t append_record(const uint32_t type,
+                                   const int_fast64_t chat_id,
+                                   const int_fast64_t value,
+                                   const char *payload)
+{
+    const size_t payload_size = payload ? strlen(payload) : 0;
+    const size_t record_size = sizeof(LogRecord) + payload_size;
+
+    LogRecord record;
+    memset(&record, 0, sizeof record);
+
+    record.chat_id = chat_id;
+    record.value = value;
+    record.payload_size = payload_size;
+    record.type = type;
+    record.checksum = get_checksum(&record, payload);
+
+    pthread_mutex_lock(&users_log_mutex);
+
+    if (dirty_records_size + record_size > dirty_records_capacity)
+    {
+        dirty_records_capacity = (dirty_records_size + record_size) * 2;
+
+        if (!(dirty_records = realloc(dirty_records, dirty_records_capacity)))
+            die("%s: %s: failed to reallocate memory for dirty_records",
+                __BASE_FILE__,
+                __func__);
+    }
+
+    memcpy(dirty_records + dirty_records_size, &record, sizeof record);
+
+    if (payload_size)
+        memcpy(dirty_records + dirty_records_size + sizeof record, payload, payload_size);
+
+    dirty_records_size += record_size;
+
+    if (!dirty_records_count++)
+        clock_gettime(CLOCK_MONOTONIC, &first_dirty_time);
+
+    const uint_fast64_t record_sequence = ++appended_sequence;
+
+    if (durability == DURABILITY_ALWAYS ||
+        dirty_records_count == 1 ||
+        dirty_records_count == MAX_DIRTY_RECORDS)
+        pthread_cond_signal(&dirty_records_cond);
+
+    pthread_mutex_unlock(&users_log_mutex);
+
+    return record_sequence;
+}
+
+static void wait_for_record(const uint_fast64_t record_sequence)
+{
+    if (durability != DURABILITY_ALWAYS || !record_sequence)
+        return;
+
+    const int_fast64_t span_start = begin_span();
+
+    pthread_mutex_lock(&users_log_mutex);
+
+    while (durable_sequence < record_sequence)
+        pthread_cond_wait(&durable_records_cond, &users_log_mutex);
+
+    pthread_mutex_unlock(&users_log_mutex);
+
+    end_span("wait_for_record", span_start);
+}
+
+// The writers lock is traced, so the waits for it show up in slow updates.
+static void lock_users(void)
+{
+    const int_fast64_t span_start = begin_span();
+
+    pthread_mutex_lock(&users_mutex);
+
+    end_span("lock_users", span_start);
+}
+
+static void replay_log(const char *log_path)
+{
+    const int log_fd = open(log_path, O_RDWR);
+
+    if (log_fd < 0)
+        return;
+
+    struct stat log_stat;
+
+    if (fstat(log_fd, &log_stat))
+        die("%s: %s: failed to stat %s",
+            __BASE_FILE__,
+            __func__,
+            log_path);
+
+    const size_t log_size = log_stat.st_size;
+    char *log = malloc(log_size + 1);
+
+    if (!log)
+        die("%s: %s: failed to allocate memory for log",
+            __BASE_FILE__,
+            __func__);
+
+    if (read(log_fd, log, log_size) != (ssize_t) log_size)
+        die("%s: %s: failed to read data from %s",
+            __BASE_FILE__,
+            __func__,
+            log_path);
+
+    size_t offset = 0;
+
+    while (offset + sizeof(LogRecord) <= log_size)
+    {
+        LogRecord record;
+        memcpy(&record, log + offset, sizeof record);
+
+        const char *payload = log + offset + sizeof record;
+
+        if (record.payload_size > log_size - offset - sizeof record ||
+            record.checksum != get_checksum(&record, payload))
+            break;
+
+        apply_record(&record, payload);
+        offset += sizeof record + record.payload_size;
+    }
+
+    // A record torn by a crash is dropped, so new records follow valid ones.
+    if (offset != log_size)
+    {
+        report("Dropped %zu bytes of a torn record from %s",
+               log_size - offset,
+               log_path);
+
+        if (ftruncate(log_fd, offset))
+            die("%s: %s: failed to truncate %s",
+                __BASE_FILE__,
+                __func__,
+                log_path);
+    }
+
+    users_log_size = offset;
+
+    free(log);
+    close(log_fd);
+}
+
+static void open_log(void)
+{
+    if ((users_log_fd = open(FILE_USERS_LOG, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_LOG);
+}
+
+static void *flush_users_log(void *arg)
+{
+    (void) arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&users_log_mutex);
+
+        while (!dirty_records_count)
+            pthread_cond_wait(&dirty_records_cond, &users_log_mutex);
+
+        if (durability != DURABILITY_ALWAYS)
+        {
+            struct timespec flush_time = first_dirty_time;
+
+            flush_time.tv_sec += flush_interval / 1000;
+            flush_time.tv_nsec += (long) (flush_interval % 1000) * 1000000;
+
+            if (flush_time.tv_nsec >= 1000000000)
+            {
+                ++flush_time.tv_sec;
+                flush_time.tv_nsec -= 1000000000;
+            }
+
+            while (dirty_records_count < MAX_DIRTY_RECORDS &&
+                   !pthread_cond_timedwait(&dirty_records_cond, &users_log_mutex, &flush_time));
+        }
+
+        pthread_mutex_unlock(&users_log_mutex);
+
+        write_records();
+
+        if (users_log_size >= MAX_USERS_LOG_SIZE)
+            compact_users();
+    }
+
+    return NULL;
+}
+
+static void write_records(void)
+{
+    // Taking and writing the records at once keeps them in the log order.
+    pthread_mutex_lock(&users_log_write_mutex);
+    pthread_mutex_lock(&users_log_mutex);
+
+    char *records = dirty_records;
+    const size_t records_size = dirty_records_size;
+    const uint_fast64_t records_sequence = appended_sequence;
+
+    dirty_records = NULL;
+    dirty_records_size = 0;
+    dirty_records_capacity = 0;
+    dirty_records_count = 0;
+
+    pthread_mutex_unlock(&users_log_mutex);
+
+    if (records_size)
+    {
+        if (write(users_log_fd, records, records_size) != (ssize_t) records_size)
+            die("%s: %s: failed to write %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS_LOG);
+
+        if (durability != DURABILITY_OFF && fdatasync(users_log_fd))
+            die("%s: %s: failed to sync %s",
+                __BASE_FILE__,
+                __func__,
+                FILE_USERS_LOG);
+
+        users_log_size += records_size;
+        add_counter(COUNTER_LOGGED_USERS_BYTES, records_size);
+    }
+
+    free(records);
+
+    pthread_mutex_lock(&users_log_mutex);
+
+    durable_sequence = records_sequence;
+
+    pthread_cond_broadcast(&durable_records_cond);
+    pthread_mutex_unlock(&users_log_mutex);
+    pthread_mutex_unlock(&users_log_write_mutex);
+}
+
+static void compact_users(void)
+{
+    // Holding the users mutex keeps writers out, so the copy contains
+    // exactly the records written to the log that is moved away.
+    pthread_mutex_lock(&compaction_mutex);
+    lock_users();
+
+    write_records();
+
+    Snapshot snapshot;
+    take_snapshot(&snapshot);
+
+    close(users_log_fd);
+
+    if (rename(FILE_USERS_LOG, FILE_USERS_OLD_LOG))
+        die("%s: %s: failed to rename %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_LOG);
+
+    open_log();
+    users_log_size = 0;
+
+    pthread_mutex_unlock(&users_mutex);
+
+    save_users(&snapshot);
+
+    if (unlink(FILE_USERS_OLD_LOG))
+        die("%s: %s: failed to remove %s",
+            __BASE_FILE__,
+            __func__,
+            FILE_USERS_OLD_LOG);
+
+    free_snapshot(&snapshot);
+
+    pthread_mutex_unlock(&compaction_mutex);
+}
+
+// FNV-1a over the record without its checksum and over the payload.
+static uint32_t get_checksum(const LogRecord *record, const char *payload)
+{
+    LogRecord header = *record;
+    header.checksum = 0;
+
+    uint32_t checksum = 2166136261u;
+
+    const unsigned char *bytes = (const unsigned char *) &header;
+
+    for (size_t i = 0; i < sizeof header; ++i)
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+
+    bytes = (const unsigned char *) payload;
+
+    for (size_t i = 0; i < record->payload_size; ++i)
+        checksum = (checksum ^ bytes[i]) * 16777619u;
+
+    return checksum;
+}
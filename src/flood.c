@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "flood.h"
+
+// A slot is idle when its chat has no debt left, idle slots are reused
+// by other chats without being cleared first.
+typedef struct
+{
+    int_fast64_t chat_id;
+    int_fast64_t theoretical_arrival_time;
+    int_fast64_t warned_until;
+}
+FloodChat;
+
+static FloodChat *find_flood_chat(const int_fast64_t chat_id, const int_fast64_t now);
+static int_fast64_t get_monotonic_time(void);
+
+static FloodChat flood_chats[MAX_FLOOD_CHATS];
+static uint_fast64_t limited_updates = 0;
+static uint_fast64_t warned_chats = 0;
+static uint_fast64_t evicted_chats = 0;
+static pthread_mutex_t flood_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns FLOOD_WARNED only for the first limited update of a chat until
+// its debt is paid off, so the chat is told to slow down once.
+int check_flood(const int_fast64_t chat_id)
+{
+    const int_fast64_t now = get_monotonic_time();
+    const int_fast64_t tolerance = (int_fast64_t) FLOOD_INTERVAL_US * (FLOOD_BURST - 1);
+
+    pthread_mutex_lock(&flood_mutex);
+
+    FloodChat *chat = find_flood_chat(chat_id, now);
+    const int_fast64_t arrival_time = chat->theoretical_arrival_time > now ? chat->theoretical_arrival_time : now;
+    int result = FLOOD_ALLOWED;
+
+    if (arrival_time - now > tolerance)
+    {
+        ++limited_updates;
+
+        if (now >= chat->warned_until)
+        {
+            chat->warned_until = arrival_time;
+            ++warned_chats;
+
+            result = FLOOD_WARNED;
+        }
+        else
+            result = FLOOD_LIMITED;
+    }
+    else
+        chat->theoretical_arrival_time = arrival_time + FLOOD_INTERVAL_US;
+
+    pthread_mutex_unlock(&flood_mutex);
+
+    return result;
+}
+
+void get_flood_stats(FloodStats *stats)
+{
+    pthread_mutex_lock(&flood_mutex);
+
+    stats->limited_updates = limited_updates;
+    stats->warned_chats = warned_chats;
+    stats->evicted_chats = evicted_chats;
+
+    pthread_mutex_unlock(&flood_mutex);
+}
+
+// Takes the first idle slot if the chat is not tracked, or evicts the
+// chat closest to paying off its debt if all the probed slots are busy.
+static FloodChat *find_flood_chat(const int_fast64_t chat_id, const int_fast64_t now)
+{
+    // The high bits of the product depend on all bits of the chat_id.
+    const uint_fast64_t hash = (uint_fast64_t) chat_id * 0x9E3779B97F4A7C15 >> 32;
+    FloodChat *idle_chat = NULL;
+    FloodChat *oldest_chat = NULL;
+
+    for (int i = 0; i < FLOOD_PROBES; ++i)
+    {
+        FloodChat *chat = &flood_chats[(hash + i) % MAX_FLOOD_CHATS];
+
+        if (chat->chat_id == chat_id)
+            return chat;
+
+        if (chat->theoretical_arrival_time <= now && chat->warned_until <= now)
+        {
+            if (!idle_chat)
+                idle_chat = chat;
+        }
+        else if (!oldest_chat || chat->theoretical_arrival_time < oldest_chat->theoretical_arrival_time)
+            oldest_chat = chat;
+    }
+
+    if (!idle_chat)
+    {
+        idle_chat = oldest_chat;
+        ++evicted_chats;
+    }
+
+    idle_chat->chat_id = chat_id;
+    idle_chat->theoretical_arrival_time = now;
+    idle_chat->warned_until = now;
+
+    return idle_chat;
+}
+
+static int_fast64_t get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int_fast64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
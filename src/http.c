@@ -0,0 +1,457 @@
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "log.h"
+#include "http.h"
+
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    time_t last_activity;
+}
+HttpConnection;
+
+static int open_listener(const char *address, const int port);
+static void accept_connections(const int listener_fd,
+                               HttpConnection *connections,
+                               int *connections_count);
+static int read_connection(HttpConnection *connection, HttpHandler handler, void *handler_arg);
+static int handle_requests(HttpConnection *connection, HttpHandler handler, void *handler_arg);
+static int send_response(const int fd, const HttpResponse *response, const int keep_alive);
+static int send_all(const int fd, const char *data, size_t data_size);
+static const char *get_status_text(const int status);
+static void close_connection(HttpConnection *connection);
+
+static atomic_int server_stopped = 0;
+
+void run_http_server(const char *address,
+                     const int port,
+                     HttpHandler handler,
+                     void *handler_arg)
+{
+    const int listener_fd = open_listener(address, port);
+
+    HttpConnection connections[MAX_HTTP_CONNECTIONS];
+    int connections_count = 0;
+
+    struct pollfd poll_fds[MAX_HTTP_CONNECTIONS + 1];
+
+    while (!atomic_load(&server_stopped))
+    {
+        poll_fds[0].fd = listener_fd;
+        poll_fds[0].events = connections_count < MAX_HTTP_CONNECTIONS ? POLLIN : 0;
+
+        for (int i = 0; i < connections_count; ++i)
+        {
+            poll_fds[i + 1].fd = connections[i].fd;
+            poll_fds[i + 1].events = POLLIN;
+        }
+
+        if (poll(poll_fds, connections_count + 1, 1000) < 0 && errno != EINTR)
+            die("%s: %s: failed to poll connections",
+                __BASE_FILE__,
+                __func__);
+
+        const time_t now = time(NULL);
+
+        // Walk backwards, closed connections are replaced by the last one.
+        for (int i = connections_count - 1; i >= 0; --i)
+        {
+            int keep = 1;
+
+            if (poll_fds[i + 1].revents)
+                keep = read_connection(&connections[i], handler, handler_arg);
+            else if (now - connections[i].last_activity > MAX_HTTP_IDLE_TIMEOUT)
+                keep = 0;
+
+            if (!keep)
+            {
+                close_connection(&connections[i]);
+                connections[i] = connections[--connections_count];
+            }
+        }
+
+        if (poll_fds[0].revents & POLLIN)
+            accept_connections(listener_fd, connections, &connections_count);
+    }
+
+    for (int i = 0; i < connections_count; ++i)
+        close_connection(&connections[i]);
+
+    close(listener_fd);
+}
+
+// Only sets a flag, so it is safe to call from a signal handler. The
+// server returns within a poll interval.
+void stop_http_server(void)
+{
+    atomic_store(&server_stopped, 1);
+}
+
+int get_http_header(const HttpRequest *request,
+                    const char *name,
+                    char *value,
+                    const size_t value_size)
+{
+    const size_t name_size = strlen(name);
+    const char *line = request->headers;
+
+    while (*line)
+    {
+        const char *line_end = strstr(line, "\r\n");
+
+        if (!line_end)
+            break;
+
+        if ((size_t) (line_end - line) > name_size &&
+            line[name_size] == ':' &&
+            !strncasecmp(line, name, name_size))
+        {
+            const char *value_start = line + name_size + 1;
+
+            while (value_start < line_end && (*value_start == ' ' || *value_start == '\t'))
+                ++value_start;
+
+            const char *value_end = line_end;
+
+            while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+                --value_end;
+
+            const size_t size = value_end - value_start;
+
+            if (size >= value_size)
+                return 0;
+
+            memcpy(value, value_start, size);
+            value[size] = 0;
+            return 1;
+        }
+
+        line = line_end + 2;
+    }
+
+    return 0;
+}
+
+static int open_listener(const char *address, const int port)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        die("%s: %s: failed to create socket",
+            __BASE_FILE__,
+            __func__);
+
+    const int reuse_address = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_address, sizeof reuse_address);
+
+    struct sockaddr_in listener_address;
+    memset(&listener_address, 0, sizeof listener_address);
+
+    listener_address.sin_family = AF_INET;
+    listener_address.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address, &listener_address.sin_addr) != 1)
+        die("%s: %s: invalid address %s",
+            __BASE_FILE__,
+            __func__,
+            address);
+
+    if (bind(fd, (struct sockaddr *) &listener_address, sizeof listener_address))
+        die("%s: %s: failed to bind %s:%d",
+            __BASE_FILE__,
+            __func__,
+            address,
+            port);
+
+    if (listen(fd, SOMAXCONN))
+        die("%s: %s: failed to listen on %s:%d",
+            __BASE_FILE__,
+            __func__,
+            address,
+            port);
+
+    return fd;
+}
+
+static void accept_connections(const int listener_fd,
+                               HttpConnection *connections,
+                               int *connections_count)
+{
+    while (*connections_count < MAX_HTTP_CONNECTIONS)
+    {
+        const int fd = accept4(listener_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+            return;
+
+        HttpConnection *connection = &connections[(*connections_count)++];
+
+        connection->fd = fd;
+        connection->buffer = NULL;
+        connection->size = 0;
+        connection->capacity = 0;
+        connection->last_activity = time(NULL);
+    }
+}
+
+static int read_connection(HttpConnection *connection, HttpHandler handler, void *handler_arg)
+{
+    for (;;)
+    {
+        if (connection->size == connection->capacity)
+        {
+            if (connection->capacity == MAX_HTTP_REQUEST_SIZE)
+            {
+                if (!handle_requests(connection, handler, handler_arg))
+                    return 0;
+
+                if (connection->size < connection->capacity)
+                    continue;
+
+                const HttpResponse response = {413, "text/plain", NULL, 0};
+                send_response(connection->fd, &response, 0);
+                return 0;
+            }
+
+            connection->capacity = connection->capacity ? connection->capacity * 2 : 4096;
+
+            if (connection->capacity > MAX_HTTP_REQUEST_SIZE)
+                connection->capacity = MAX_HTTP_REQUEST_SIZE;
+
+            // Keep one byte for the terminating zero of the request body.
+            connection->buffer = realloc(connection->buffer, connection->capacity + 1);
+
+            if (!connection->buffer)
+                die("%s: %s: failed to reallocate memory for connection->buffer",
+                    __BASE_FILE__,
+                    __func__);
+        }
+
+        const ssize_t read_size = recv(connection->fd,
+                                       connection->buffer + connection->size,
+                                       connection->capacity - connection->size,
+                                       0);
+
+        if (read_size > 0)
+        {
+            connection->size += read_size;
+            connection->last_activity = time(NULL);
+            continue;
+        }
+
+        if (!read_size)
+            return 0;
+
+        if (errno == EINTR)
+            continue;
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+
+        return handle_requests(connection, handler, handler_arg);
+    }
+}
+
+static int handle_requests(HttpConnection *connection, HttpHandler handler, void *handler_arg)
+{
+    for (;;)
+    {
+        char *buffer = connection->buffer;
+
+        if (!buffer)
+            return 1;
+
+        char *headers_end = memmem(buffer, connection->size, "\r\n\r\n", 4);
+
+        if (!headers_end)
+        {
+            if (connection->size > MAX_HTTP_HEADER_SIZE)
+            {
+                const HttpResponse response = {431, "text/plain", NULL, 0};
+                send_response(connection->fd, &response, 0);
+                return 0;
+            }
+
+            return 1;
+        }
+
+        char *body = headers_end + 4;
+        const size_t headers_size = body - buffer;
+
+        // The headers are parsed as strings, so they cannot contain NUL bytes.
+        char *request_line_end = memchr(buffer, 0, headers_size) ? NULL : memmem(buffer, headers_size, "\r\n", 2);
+
+        if (!request_line_end)
+        {
+            const HttpResponse response = {400, "text/plain", NULL, 0};
+            send_response(connection->fd, &response, 0);
+            return 0;
+        }
+
+        // Terminate the request line and the headers in place.
+        headers_end[2] = 0;
+        *request_line_end = 0;
+
+        HttpRequest request;
+        request.headers = request_line_end + 2;
+
+        char *method_end = strchr(buffer, ' ');
+        char *path_end = method_end ? strchr(method_end + 1, ' ') : NULL;
+
+        if (!path_end)
+        {
+            const HttpResponse response = {400, "text/plain", NULL, 0};
+            send_response(connection->fd, &response, 0);
+            return 0;
+        }
+
+        *method_end = 0;
+        *path_end = 0;
+
+        request.method = buffer;
+        request.path = method_end + 1;
+
+        char connection_header[32];
+
+        const int keep_alive = !strcmp(path_end + 1, "HTTP/1.1") &&
+                               !(get_http_header(&request, "Connection", connection_header, sizeof connection_header) &&
+                                 !strcasecmp(connection_header, "close"));
+
+        char content_length[32];
+        size_t body_size = 0;
+
+        if (get_http_header(&request, "Content-Length", content_length, sizeof content_length))
+        {
+            char *end;
+            body_size = strtoull(content_length, &end, 10);
+
+            if (*end || end == content_length || body_size > MAX_HTTP_REQUEST_SIZE - headers_size)
+            {
+                const HttpResponse response = {413, "text/plain", NULL, 0};
+                send_response(connection->fd, &response, 0);
+                return 0;
+            }
+        }
+
+        if (connection->size < headers_size + body_size)
+        {
+            // Restore the buffer, the body is not received yet.
+            *method_end = ' ';
+            *path_end = ' ';
+            *request_line_end = '\r';
+            headers_end[2] = '\r';
+
+            return 1;
+        }
+
+        const char saved_byte = body[body_size];
+        body[body_size] = 0;
+
+        request.body = body;
+        request.body_size = body_size;
+
+        HttpResponse response = {200, "text/plain", NULL, 0};
+        handler(&request, &response, handler_arg);
+
+        const int sent = send_response(connection->fd, &response, keep_alive);
+        free(response.body);
+
+        if (!sent || !keep_alive)
+            return 0;
+
+        body[body_size] = saved_byte;
+
+        connection->size -= headers_size + body_size;
+        memmove(buffer, body + body_size, connection->size);
+    }
+}
+
+static int send_response(const int fd, const HttpResponse *response, const int keep_alive)
+{
+    char headers[256];
+    const int headers_size = snprintf(headers,
+                                      sizeof headers,
+                                      "HTTP/1.1 %d %s\r\n"
+                                      "Content-Type: %s\r\n"
+                                      "Content-Length: %zu\r\n"
+                                      "Connection: %s\r\n"
+                                      "\r\n",
+                                      response->status,
+                                      get_status_text(response->status),
+                                      response->content_type,
+                                      response->body_size,
+                                      keep_alive ? "keep-alive" : "close");
+
+    return send_all(fd, headers, headers_size) &&
+           send_all(fd, response->body, response->body_size);
+}
+
+static int send_all(const int fd, const char *data, size_t data_size)
+{
+    while (data_size)
+    {
+        const ssize_t sent_size = send(fd, data, data_size, MSG_NOSIGNAL);
+
+        if (sent_size > 0)
+        {
+            data += sent_size;
+            data_size -= sent_size;
+            continue;
+        }
+
+        if (sent_size < 0 && errno == EINTR)
+            continue;
+
+        if (sent_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            struct pollfd poll_fd = {fd, POLLOUT, 0};
+
+            if (poll(&poll_fd, 1, MAX_HTTP_SEND_TIMEOUT) > 0)
+                continue;
+        }
+
+        return 0;
+    }
+
+    return 1;
+}
+
+static const char *get_status_text(const int status)
+{
+    switch (status)
+    {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Content Too Large";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default:  return "Internal Server Error";
+    }
+}
+
+static void close_connection(HttpConnection *connection)
+{
+    close(connection->fd);
+    free(connection->buffer);
+}
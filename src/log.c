@@ -1,71 +1,677 @@
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <glob.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
 #include <time.h>
 
 #include "log.h"
 
-static pthread_mutex_t info_log_mutex  = PTHREAD_MUTEX_INITIALIZER;
+#define LOG_FILE_INFO   0
+#define LOG_FILE_EVENTS 1
+#define LOG_FILE_TRACES 2
+#define LOG_FILES_COUNT 3
+
+// A slot of the position p is free when its sequence is p / LOG_RING_SIZE * 2
+// and is published when it is one more, so the zeroed ring is empty.
+typedef struct
+{
+    _Atomic size_t sequence;
+    int file;
+    size_t size;
+    char text[MAX_LOG_RECORD_SIZE];
+}
+LogRecord;
+
+// The log files are only touched under the log files mutex, so the
+// rotation runs on the writer thread and never blocks the handlers.
+typedef struct
+{
+    const char *path;
+    int fd;
+    size_t size;
+    time_t rotation_time;
+}
+LogFile;
+
+static LogRecord *claim_record(size_t *position);
+static void publish_record(LogRecord *record, const size_t position);
+static void *write_log_files(void *arg);
+static void flush_log_files(void);
+static size_t write_records(void);
+static void write_file_records(LogFile *file, const struct iovec *records, const size_t records_count);
+static int has_records(void);
+static void open_log_file(LogFile *file);
+static void rotate_log_file(LogFile *file);
+static void compress_log_file(const char *rotated_path);
+static void remove_rotated_log_files(const LogFile *file);
+static void wake_log_writer(void);
+static size_t format_record(char *text, const size_t text_size, const char *fmt, va_list argp);
+static size_t format_event(char *text,
+                           const size_t text_size,
+                           const int level,
+                           const char *event,
+                           const int sample_rate,
+                           const LogField *fields,
+                           const size_t fields_count);
+static size_t append_json_string(char *text, const size_t text_size, size_t size, const char *string);
+static const char *get_timestamp(void);
+
+extern char **environ;
+
+static const char *const log_level_names[] = {"debug", "info", "warning", "error"};
+
+// Handlers only claim and publish slots, the records are written by the
+// writer thread, or by the reporting thread until the writer is started.
+static LogRecord log_records[LOG_RING_SIZE];
+static _Atomic size_t log_head = 0;
+static _Atomic size_t log_tail = 0;
+static atomic_uint_fast64_t dropped_records = 0;
+static atomic_int log_level = LOG_LEVEL_INFO;
+
+static LogFile log_files[LOG_FILES_COUNT] =
+{
+    {FILE_INFOLOG,  -1, 0, 0},
+    {FILE_EVENTLOG, -1, 0, 0},
+    {FILE_TRACELOG, -1, 0, 0}
+};
+static int compress_log_files = 0;
+static pid_t compressor_pid = 0;
+static atomic_int log_files_reopen = 0;
+
+static atomic_int log_writer_started = 0;
+static atomic_int log_writer_waiting = 0;
+static pthread_mutex_t log_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond;
+
+static pthread_mutex_t log_files_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t error_log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void report(const char *fmt, ...)
+static _Thread_local int writes_log_files = 0;
+static _Thread_local time_t timestamp_time = 0;
+static _Thread_local char timestamp[MAX_TIMESTAMP_SIZE + 1];
+
+void init_log_module(const int compress_logs, const int level)
 {
-    pthread_mutex_lock(&info_log_mutex);
+    compress_log_files = compress_logs;
+    atomic_store(&log_level, level);
 
-    FILE *info_log = fopen(FILE_INFOLOG, "a");
+    pthread_condattr_t log_writer_condattr;
+    pthread_condattr_init(&log_writer_condattr);
+    pthread_condattr_setclock(&log_writer_condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_writer_cond, &log_writer_condattr);
+    pthread_condattr_destroy(&log_writer_condattr);
 
-    if (!info_log)
-        die("%s: %s: failed to open %s",
+    pthread_mutex_lock(&log_files_mutex);
+    writes_log_files = 1;
+
+    for (int i = 0; i < LOG_FILES_COUNT; ++i)
+        if (log_files[i].fd < 0)
+            open_log_file(&log_files[i]);
+
+    writes_log_files = 0;
+    pthread_mutex_unlock(&log_files_mutex);
+
+    pthread_t log_writer_thread;
+
+    if (pthread_create(&log_writer_thread,
+                       NULL,
+                       write_log_files,
+                       NULL))
+        die("%s: %s: failed to create log_writer_thread",
             __BASE_FILE__,
-            __func__,
-            FILE_INFOLOG);
+            __func__);
 
-    const time_t current_time = time(NULL);
+    pthread_detach(log_writer_thread);
+
+    atomic_store(&log_writer_started, 1);
+}
 
-    char timestamp[MAX_TIMESTAMP_SIZE + 1];
-    strftime(timestamp,
-             sizeof timestamp,
-             "[%Y-%m-%d %H:%M:%S]",
-             localtime(&current_time));
+// Writes the pending records, the later ones are written synchronously.
+void close_log_module(void)
+{
+    atomic_store(&log_writer_started, 0);
+    flush_log_files();
+}
+
+// Only sets a flag, so it is safe to call from a signal handler.
+void reopen_log(void)
+{
+    atomic_store(&log_files_reopen, 1);
+}
+
+// Returns -1 if the name is not a level.
+int parse_log_level(const char *name)
+{
+    for (int i = 0; i < LOG_LEVELS_COUNT; ++i)
+        if (!strcmp(name, log_level_names[i]))
+            return i;
+
+    return -1;
+}
+
+void report(const char *fmt, ...)
+{
+    size_t position;
+    LogRecord *record = claim_record(&position);
+
+    if (!record)
+        return;
 
-    fprintf(info_log, "%s ", timestamp);
     va_list argp;
     va_start(argp, fmt);
-    vfprintf(info_log, fmt, argp);
+    record->size = format_record(record->text, sizeof record->text, fmt, argp);
     va_end(argp);
-    fputc('\n', info_log);
 
-    fclose(info_log);
+    record->file = LOG_FILE_INFO;
+
+    publish_record(record, position);
+}
+
+// Writes the event as a JSON line to the events log. Sampled events keep
+// their sample rate, so the counts can be scaled back.
+void log_event(const int level,
+               const char *event,
+               const int sample_rate,
+               const LogField *fields,
+               const size_t fields_count)
+{
+    if (level < atomic_load(&log_level))
+        return;
+
+    size_t position;
+    LogRecord *record = claim_record(&position);
+
+    if (!record)
+        return;
 
-    pthread_mutex_unlock(&info_log_mutex);
+    record->size = format_event(record->text,
+                                sizeof record->text,
+                                level,
+                                event,
+                                sample_rate,
+                                fields,
+                                fields_count);
+    record->file = LOG_FILE_EVENTS;
+
+    publish_record(record, position);
+}
+
+// Writes the trace as an event to the trace log, the traces are filtered
+// by their threshold instead of the level.
+void log_trace(const char *event, const LogField *fields, const size_t fields_count)
+{
+    size_t position;
+    LogRecord *record = claim_record(&position);
+
+    if (!record)
+        return;
+
+    record->size = format_event(record->text,
+                                sizeof record->text,
+                                LOG_LEVEL_INFO,
+                                event,
+                                1,
+                                fields,
+                                fields_count);
+    record->file = LOG_FILE_TRACES;
+
+    publish_record(record, position);
 }
 
 void die(const char *fmt, ...)
 {
+    // The records reported before the failure are not lost with it,
+    // unless the failure is in writing them.
+    if (!writes_log_files)
+        flush_log_files();
+
     pthread_mutex_lock(&error_log_mutex);
 
     FILE *error_log = fopen(FILE_ERRORLOG, "a");
 
     if (error_log)
     {
-        const time_t current_time = time(NULL);
-
-        char timestamp[MAX_TIMESTAMP_SIZE + 1];
-        strftime(timestamp,
-                 sizeof timestamp,
-                 "[%Y-%m-%d %H:%M:%S]",
-                 localtime(&current_time));
+        char text[MAX_LOG_RECORD_SIZE];
 
-        fprintf(error_log, "%s ", timestamp);
         va_list argp;
         va_start(argp, fmt);
-        vfprintf(error_log, fmt, argp);
+        const size_t size = format_record(text, sizeof text, fmt, argp);
         va_end(argp);
-        fputc('\n', error_log);
 
+        fwrite(text, 1, size, error_log);
         fclose(error_log);
     }
 
     exit(EXIT_FAILURE);
 }
+
+// Returns NULL if the writer is a whole ring behind, so the record is
+// lost instead of blocking the handler.
+static LogRecord *claim_record(size_t *position)
+{
+    *position = atomic_load(&log_head);
+
+    for (;;)
+    {
+        LogRecord *record = &log_records[*position % LOG_RING_SIZE];
+
+        const size_t lap = *position / LOG_RING_SIZE * 2;
+        const size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+        if (sequence == lap)
+        {
+            if (atomic_compare_exchange_weak(&log_head, position, *position + 1))
+                return record;
+        }
+        else if (sequence < lap)
+        {
+            atomic_fetch_add(&dropped_records, 1);
+            return NULL;
+        }
+        else
+            *position = atomic_load(&log_head);
+    }
+}
+
+static void publish_record(LogRecord *record, const size_t position)
+{
+    atomic_store_explicit(&record->sequence,
+                          position / LOG_RING_SIZE * 2 + 1,
+                          memory_order_release);
+
+    if (atomic_load(&log_writer_started))
+        wake_log_writer();
+    else
+        flush_log_files();
+}
+
+static void *write_log_files(void *arg)
+{
+    (void) arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&log_files_mutex);
+        writes_log_files = 1;
+
+        const size_t records_count = write_records();
+
+        writes_log_files = 0;
+        pthread_mutex_unlock(&log_files_mutex);
+
+        if (records_count)
+            continue;
+
+        const uint_fast64_t dropped_count = atomic_exchange(&dropped_records, 0);
+
+        if (dropped_count)
+            report("Dropped %" PRIuFAST64 " log records", dropped_count);
+
+        // The reporters signal only a waiting writer, so the flag is set
+        // under the mutex before the last check for new records.
+        pthread_mutex_lock(&log_writer_mutex);
+
+        atomic_store(&log_writer_waiting, 1);
+
+        if (!has_records())
+        {
+            struct timespec timeout;
+            clock_gettime(CLOCK_MONOTONIC, &timeout);
+
+            timeout.tv_sec += LOG_WAIT_TIMEOUT_MS / 1000;
+            timeout.tv_nsec += LOG_WAIT_TIMEOUT_MS % 1000 * 1000000;
+
+            if (timeout.tv_nsec >= 1000000000)
+            {
+                ++timeout.tv_sec;
+                timeout.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&log_writer_cond, &log_writer_mutex, &timeout);
+        }
+
+        atomic_store(&log_writer_waiting, 0);
+
+        pthread_mutex_unlock(&log_writer_mutex);
+    }
+
+    return NULL;
+}
+
+static void flush_log_files(void)
+{
+    pthread_mutex_lock(&log_files_mutex);
+    writes_log_files = 1;
+
+    while (write_records())
+        ;
+
+    writes_log_files = 0;
+    pthread_mutex_unlock(&log_files_mutex);
+}
+
+// Writes up to LOG_BATCH_SIZE published records with one writev() per
+// log file and frees their slots, the log files mutex has to be held.
+static size_t write_records(void)
+{
+    const size_t tail = atomic_load(&log_tail);
+
+    struct iovec records[LOG_FILES_COUNT][LOG_BATCH_SIZE];
+    size_t file_records_counts[LOG_FILES_COUNT] = {0};
+    size_t records_count = 0;
+
+    for (; records_count < LOG_BATCH_SIZE; ++records_count)
+    {
+        const size_t position = tail + records_count;
+        LogRecord *record = &log_records[position % LOG_RING_SIZE];
+
+        if (atomic_load_explicit(&record->sequence, memory_order_acquire) != position / LOG_RING_SIZE * 2 + 1)
+            break;
+
+        struct iovec *file_record = &records[record->file][file_records_counts[record->file]++];
+        file_record->iov_base = record->text;
+        file_record->iov_len = record->size;
+    }
+
+    if (!records_count)
+        return 0;
+
+    if (atomic_exchange(&log_files_reopen, 0))
+        for (int i = 0; i < LOG_FILES_COUNT; ++i)
+            if (log_files[i].fd >= 0)
+            {
+                close(log_files[i].fd);
+                log_files[i].fd = -1;
+            }
+
+    for (int i = 0; i < LOG_FILES_COUNT; ++i)
+        if (file_records_counts[i])
+            write_file_records(&log_files[i], records[i], file_records_counts[i]);
+
+    for (size_t i = 0; i < records_count; ++i)
+    {
+        const size_t position = tail + i;
+
+        atomic_store_explicit(&log_records[position % LOG_RING_SIZE].sequence,
+                              (position / LOG_RING_SIZE + 1) * 2,
+                              memory_order_release);
+    }
+
+    atomic_store(&log_tail, tail + records_count);
+
+    return records_count;
+}
+
+static void write_file_records(LogFile *file, const struct iovec *records, const size_t records_count)
+{
+    size_t records_size = 0;
+
+    for (size_t i = 0; i < records_count; ++i)
+        records_size += records[i].iov_len;
+
+    if (file->fd < 0)
+        open_log_file(file);
+    else if (file->size &&
+             (file->size + records_size > MAX_LOG_FILE_SIZE || time(NULL) >= file->rotation_time))
+        rotate_log_file(file);
+
+    // The logs are not worth dying for, the records are dropped if the
+    // write fails.
+    const ssize_t written_size = writev(file->fd, records, records_count);
+
+    if (written_size > 0)
+        file->size += written_size;
+
+    if (written_size != (ssize_t) records_size)
+        atomic_fetch_add(&dropped_records, records_count);
+}
+
+static int has_records(void)
+{
+    const size_t tail = atomic_load(&log_tail);
+
+    return atomic_load(&log_records[tail % LOG_RING_SIZE].sequence) == tail / LOG_RING_SIZE * 2 + 1;
+}
+
+// Opens the log file and schedules its rotation for the next midnight.
+static void open_log_file(LogFile *file)
+{
+    if ((file->fd = open(file->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+        die("%s: %s: failed to open %s",
+            __BASE_FILE__,
+            __func__,
+            file->path);
+
+    struct stat file_stat;
+    file->size = fstat(file->fd, &file_stat) ? 0 : file_stat.st_size;
+
+    const time_t current_time = time(NULL);
+
+    struct tm rotation_tm;
+    localtime_r(&current_time, &rotation_tm);
+
+    rotation_tm.tm_mday += 1;
+    rotation_tm.tm_hour = 0;
+    rotation_tm.tm_min = 0;
+    rotation_tm.tm_sec = 0;
+    rotation_tm.tm_isdst = -1;
+
+    file->rotation_time = mktime(&rotation_tm);
+}
+
+// Renames the log file after the rotation time, the log file keeps being
+// appended if it can not be renamed.
+static void rotate_log_file(LogFile *file)
+{
+    const time_t current_time = time(NULL);
+
+    struct tm current_tm;
+    localtime_r(&current_time, &current_tm);
+
+    char suffix[MAX_ROTATED_SUFFIX_SIZE + 1];
+    strftime(suffix, sizeof suffix, ".%Y%m%d-%H%M%S", &current_tm);
+
+    // Size rotations can happen more than once a second, so the rotated
+    // logs of a second are numbered, even the already compressed ones.
+    char rotated_path[MAX_LOG_PATH_SIZE + MAX_ROTATED_SUFFIX_SIZE + 12];
+    char compressed_path[sizeof rotated_path + 3];
+
+    for (int i = 0;; ++i)
+    {
+        snprintf(rotated_path, sizeof rotated_path, "%s%s.%d", file->path, suffix, i);
+        snprintf(compressed_path, sizeof compressed_path, "%s.gz", rotated_path);
+
+        if (access(rotated_path, F_OK) && access(compressed_path, F_OK))
+            break;
+    }
+
+    close(file->fd);
+
+    const int rotated = !rename(file->path, rotated_path);
+
+    open_log_file(file);
+
+    if (!rotated)
+        return;
+
+    if (compress_log_files)
+        compress_log_file(rotated_path);
+
+    remove_rotated_log_files(file);
+}
+
+// Compresses the rotated log in the background, the log is left as it
+// is while the previous one is still being compressed.
+static void compress_log_file(const char *rotated_path)
+{
+    if (compressor_pid > 0 && !waitpid(compressor_pid, NULL, WNOHANG))
+        return;
+
+    char *const argv[] = {LOG_COMPRESSOR, "-q", "--", (char *) rotated_path, NULL};
+
+    if (posix_spawnp(&compressor_pid, LOG_COMPRESSOR, NULL, NULL, argv, environ))
+        compressor_pid = 0;
+}
+
+// The rotated logs are named by their time, so the sorted names start
+// with the oldest ones.
+static void remove_rotated_log_files(const LogFile *file)
+{
+    char pattern[MAX_LOG_PATH_SIZE + 3];
+    snprintf(pattern, sizeof pattern, "%s.*", file->path);
+
+    glob_t rotated_logs;
+
+    if (glob(pattern, 0, NULL, &rotated_logs))
+        return;
+
+    for (size_t i = 0; i + MAX_ROTATED_LOGS < rotated_logs.gl_pathc; ++i)
+        unlink(rotated_logs.gl_pathv[i]);
+
+    globfree(&rotated_logs);
+}
+
+static void wake_log_writer(void)
+{
+    if (!atomic_exchange(&log_writer_waiting, 0))
+        return;
+
+    pthread_mutex_lock(&log_writer_mutex);
+    pthread_cond_signal(&log_writer_cond);
+    pthread_mutex_unlock(&log_writer_mutex);
+}
+
+// Formats the timestamped record with a trailing newline.
+static size_t format_record(char *text, const size_t text_size, const char *fmt, va_list argp)
+{
+    int size = snprintf(text, text_size - 1, "[%s] ", get_timestamp());
+    const int message_size = vsnprintf(text + size, text_size - 1 - size, fmt, argp);
+
+    size += message_size < 0 ? 0 : message_size;
+
+    if ((size_t) size > text_size - 2)
+        size = text_size - 2;
+
+    text[size++] = '\n';
+
+    return size;
+}
+
+// A truncated event is still a valid JSON object, its fields are only
+// added while they fit.
+static size_t format_event(char *text,
+                           const size_t text_size,
+                           const int level,
+                           const char *event,
+                           const int sample_rate,
+                           const LogField *fields,
+                           const size_t fields_count)
+{
+    // Two bytes are kept for the closing brace and the newline.
+    const size_t fields_size = text_size - 2;
+
+    size_t size = snprintf(text,
+                           fields_size,
+                           "{\"time\":\"%s\",\"level\":\"%s\",\"event\":",
+                           get_timestamp(),
+                           log_level_names[level]);
+    size = append_json_string(text, fields_size, size, event);
+
+    if (sample_rate > 1 && size < fields_size)
+        size += snprintf(text + size, fields_size - size, ",\"sample_rate\":%d", sample_rate);
+
+    for (size_t i = 0; i < fields_count && size < fields_size; ++i)
+    {
+        const size_t field_start = size;
+
+        size += snprintf(text + size, fields_size - size, ",\"%s\":", fields[i].key);
+
+        if (size < fields_size)
+        {
+            if (fields[i].type == LOG_FIELD_INT)
+                size += snprintf(text + size, fields_size - size, "%" PRIdFAST64, fields[i].integer);
+            else if (fields[i].type == LOG_FIELD_JSON && fields[i].string)
+                size += snprintf(text + size, fields_size - size, "%s", fields[i].string);
+            else if (fields[i].string)
+                size = append_json_string(text, fields_size, size, fields[i].string);
+            else
+                size += snprintf(text + size, fields_size - size, "null");
+        }
+
+        if (size >= fields_size)
+            size = field_start;
+    }
+
+    if (size >= fields_size)
+        size = fields_size - 1;
+
+    text[size++] = '}';
+    text[size++] = '\n';
+
+    return size;
+}
+
+// Returns the size past text_size if the string does not fit.
+static size_t append_json_string(char *text, const size_t text_size, size_t size, const char *string)
+{
+    if (size + 1 >= text_size)
+        return text_size;
+
+    text[size++] = '"';
+
+    for (; *string; ++string)
+    {
+        const unsigned char c = *string;
+
+        if (size + 7 >= text_size)
+            return text_size;
+
+        if (c == '"' || c == '\\')
+        {
+            text[size++] = '\\';
+            text[size++] = c;
+        }
+        else if (c < 0x20)
+            size += snprintf(text + size, text_size - size, "\\u%04x", c);
+        else
+            text[size++] = c;
+    }
+
+    if (size + 1 >= text_size)
+        return text_size;
+
+    text[size++] = '"';
+
+    return size;
+}
+
+// The timestamp is formatted once a second per thread.
+static const char *get_timestamp(void)
+{
+    const time_t current_time = time(NULL);
+
+    if (current_time != timestamp_time)
+    {
+        struct tm current_tm;
+        localtime_r(&current_time, &current_tm);
+
+        strftime(timestamp,
+                 sizeof timestamp,
+                 "%Y-%m-%d %H:%M:%S",
+                 &current_tm);
+
+        timestamp_time = current_time;
+    }
+
+    return timestamp;
+}
@@ -12,8 +12,12 @@
 
 #include "version.h"
 #include "log.h"
+#include "arena.h"
 #include "requests.h"
 #include "data.h"
+#include "workers.h"
+#include "metrics.h"
+#include "trace.h"
 #include "bot.h"
 
 #define ERRORSTAMP "\e[0;31;1mError:\e[0m"
@@ -22,9 +26,11 @@
 #define FILE_LOCK "bolochagina-tgbot.lock"
 
 static void handle_args(int argc, char **argv);
+static int parse_durability(const char *durability);
 static void init_pw(void);
 static void check_instance(void);
 static void drop_privileges(void);
+static void convert_users(void);
 static void daemonize(void);
 static void init_signals(void);
 static void init_modules(void);
@@ -32,11 +38,22 @@ static void init_info(void);
 static void handle_signal(const int signal);
 
 static int maintenance_mode = 0;
+static int webhook_mode = 0;
+static int metrics_enabled = 0;
+static int compress_logs = 0;
+static int log_level = LOG_LEVEL_INFO;
+static int trace_threshold = 0;
+static int workers_count = 0;
+static int durability_policy = DURABILITY_INTERVAL;
+static int flush_interval = DEFAULT_FLUSH_INTERVAL_MS;
+static const char *import_path = NULL;
+static const char *export_path = NULL;
 
 static struct passwd *pw;
 
 static pid_t pid;
 static char *mode;
+static char *updates_source;
 
 int main(int argc, char **argv)
 {
@@ -46,20 +63,38 @@ int main(int argc, char **argv)
     check_instance();
     drop_privileges();
 
+    if (import_path || export_path)
+        convert_users();
+
     daemonize();
 
     init_signals();
     init_modules();
     init_info();
 
-    report("bolochagina-tgbot %d.%d.%d started (PID: %d; Mode: %s)",
+    report("bolochagina-tgbot %d.%d.%d started (PID: %d; Mode: %s; Updates: %s)",
+           MAJOR_VERSION,
+           MINOR_VERSION,
+           PATCH_VERSION,
+           pid,
+           mode,
+           updates_source);
+
+    start_bot(maintenance_mode, webhook_mode);
+
+    if (!maintenance_mode)
+        close_data_module();
+
+    report("bolochagina-tgbot %d.%d.%d terminated (PID: %d; Mode: %s)",
            MAJOR_VERSION,
            MINOR_VERSION,
            PATCH_VERSION,
            pid,
            mode);
 
-    start_bot(maintenance_mode);
+    close_log_module();
+
+    return EXIT_SUCCESS;
 }
 
 static void handle_args(int argc, char **argv)
@@ -71,9 +106,18 @@ static void handle_args(int argc, char **argv)
 
     static const struct option long_options[] =
     {
-        {"help",        no_argument, 0, 'h'},
-        {"version",     no_argument, 0, 'v'},
-        {"maintenance", no_argument, 0, 'm'},
+        {"help",          no_argument,       0, 'h'},
+        {"version",       no_argument,       0, 'v'},
+        {"maintenance",   no_argument,       0, 'm'},
+        {"webhook",       no_argument,       0, 'w'},
+        {"metrics",       no_argument,       0, 's'},
+        {"compress-logs", no_argument,       0, 'z'},
+        {"log-level",     required_argument, 0, 'l'},
+        {"trace",         required_argument, 0, 't'},
+        {"workers",       required_argument, 0, 'j'},
+        {"durability",    required_argument, 0, 'd'},
+        {"import",        required_argument, 0, 'i'},
+        {"export",        required_argument, 0, 'e'},
         {0, 0, 0, 0}
     };
 
@@ -81,7 +125,7 @@ static void handle_args(int argc, char **argv)
 
     while ((opt = getopt_long(argc,
                               argv,
-                              "+hvm",
+                              "+hvmwszl:t:j:d:i:e:",
                               long_options,
                               NULL)) != -1)
     {
@@ -94,8 +138,26 @@ static void handle_args(int argc, char **argv)
                        "  -h, --help           print this help and exit\n"
                        "  -v, --version        print the bolochagina-tgbot version and exit\n"
                        "  -m, --maintenance    run the bolochagina-tgbot in maintenance mode\n"
+                       "  -w, --webhook        receive updates on the webhook at %s:%d instead of polling\n"
+                       "  -s, --metrics        serve the Prometheus metrics at http://%s:%d%s\n"
+                       "  -z, --compress-logs  compress the rotated logs with " LOG_COMPRESSOR "\n"
+                       "  -l, --log-level=L    write the events of the level L or higher: debug, info, warning\n"
+                       "                       or error (default: info)\n"
+                       "  -t, --trace=MS       write the traces of the updates handled longer than MS milliseconds\n"
+                       "                       to the trace log\n"
+                       "  -j, --workers=N      handle updates with N worker threads (default: number of CPUs)\n"
+                       "  -d, --durability=P   sync users changes with the policy P: always, interval[=MS] or off\n"
+                       "                       (default: interval=%d)\n"
+                       "  -i, --import=FILE    replace the users with the ones from the JSON FILE and exit\n"
+                       "  -e, --export=FILE    write the users to the JSON FILE and exit\n"
                        "\nTo run the bolochagina-tgbot, run it with the superuser privileges."
-                       "\nbolochagina-tgbot will automatically drop privileges to the bolochagina-tgbot user.\n");
+                       "\nbolochagina-tgbot will automatically drop privileges to the bolochagina-tgbot user.\n",
+                       WEBHOOK_ADDRESS,
+                       WEBHOOK_PORT,
+                       METRICS_ADDRESS,
+                       METRICS_PORT,
+                       METRICS_PATH,
+                       DEFAULT_FLUSH_INTERVAL_MS);
                 exit(EXIT_SUCCESS);
 
             case 'v':
@@ -109,8 +171,91 @@ static void handle_args(int argc, char **argv)
                 maintenance_mode = 1;
                 break;
 
+            case 'w':
+                webhook_mode = 1;
+                break;
+
+            case 's':
+                metrics_enabled = 1;
+                break;
+
+            case 'z':
+                compress_logs = 1;
+                break;
+
+            case 'l':
+                if ((log_level = parse_log_level(optarg)) < 0)
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " log level must be debug, info, warning or error\n"
+                            "Try 'bolochagina-tgbot -h' for more information.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 't':
+            {
+                char *end;
+                const long value = strtol(optarg, &end, 10);
+
+                if (*end || end == optarg || value < 1 || value > MAX_TRACE_THRESHOLD_MS)
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " trace threshold must be from 1 to %d milliseconds\n"
+                            "Try 'bolochagina-tgbot -h' for more information.\n",
+                            MAX_TRACE_THRESHOLD_MS);
+                    exit(EXIT_FAILURE);
+                }
+
+                trace_threshold = value;
+                break;
+            }
+
+            case 'j':
+            {
+                char *end;
+                const long value = strtol(optarg, &end, 10);
+
+                if (*end || end == optarg || value < 1 || value > MAX_WORKERS)
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " workers count must be from 1 to %d\n"
+                            "Try 'bolochagina-tgbot -h' for more information.\n",
+                            MAX_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+
+                workers_count = value;
+                break;
+            }
+
+            case 'd':
+                if (!parse_durability(optarg))
+                {
+                    fprintf(stderr,
+                            ERRORSTAMP " durability must be always, interval[=MS] or off\n"
+                            "Try 'bolochagina-tgbot -h' for more information.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                break;
+
+            case 'i':
+                import_path = optarg;
+                break;
+
+            case 'e':
+                export_path = optarg;
+                break;
+
             case '?':
-                if (optopt)
+                if (optopt == 'l' || optopt == 't' || optopt == 'j' || optopt == 'd' || optopt == 'i' || optopt == 'e')
+                    fprintf(stderr,
+                            ERRORSTAMP " option '-%c' requires an argument\n"
+                            "Try 'bolochagina-tgbot -h' for more information.\n",
+                            optopt);
+                else if (optopt)
                     fprintf(stderr,
                             ERRORSTAMP " unknown option '-%c'\n"
                             "Try 'bolochagina-tgbot -h' for more information.\n",
@@ -128,6 +273,14 @@ static void handle_args(int argc, char **argv)
         }
     }
 
+    if (import_path && export_path)
+    {
+        fprintf(stderr,
+                ERRORSTAMP " options '-i' and '-e' are mutually exclusive\n"
+                "Try 'bolochagina-tgbot -h' for more information.\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (optind < argc)
     {
         fprintf(stderr,
@@ -137,6 +290,42 @@ static void handle_args(int argc, char **argv)
     }
 }
 
+static int parse_durability(const char *durability)
+{
+    if (!strcmp(durability, "always"))
+    {
+        durability_policy = DURABILITY_ALWAYS;
+        return 1;
+    }
+
+    if (!strcmp(durability, "off"))
+    {
+        durability_policy = DURABILITY_OFF;
+        flush_interval = DEFAULT_FLUSH_INTERVAL_MS;
+        return 1;
+    }
+
+    if (!strcmp(durability, "interval"))
+    {
+        durability_policy = DURABILITY_INTERVAL;
+        flush_interval = DEFAULT_FLUSH_INTERVAL_MS;
+        return 1;
+    }
+
+    if (strncmp(durability, "interval=", 9))
+        return 0;
+
+    char *end;
+    const long value = strtol(durability + 9, &end, 10);
+
+    if (end == durability + 9 || (*end && strcmp(end, "ms")) || value < 1 || value > MAX_FLUSH_INTERVAL_MS)
+        return 0;
+
+    durability_policy = DURABILITY_INTERVAL;
+    flush_interval = value;
+    return 1;
+}
+
 static void init_pw(void)
 {
     if (!(pw = getpwnam("bolochagina-tgbot")))
@@ -228,6 +417,21 @@ static void drop_privileges(void)
     }
 }
 
+static void convert_users(void)
+{
+    // The instance lock is held, so the users are not changed meanwhile.
+    if (import_path)
+        printf("Imported %zu users from %s\n",
+               import_users(import_path),
+               import_path);
+    else
+        printf("Exported %zu users to %s\n",
+               export_users(export_path),
+               export_path);
+
+    exit(EXIT_SUCCESS);
+}
+
 static void daemonize(void)
 {
     if (daemon(0, 0) < 0)
@@ -241,35 +445,45 @@ static void daemonize(void)
 static void init_signals(void)
 {
     signal(SIGTERM, handle_signal);
+    signal(SIGHUP, handle_signal);
     signal(SIGSEGV, handle_signal);
 }
 
 static void init_modules(void)
 {
+    init_log_module(compress_logs, log_level);
+    init_trace_module(trace_threshold);
+    init_arena_module();
     init_requests_module();
+    init_workers_module(workers_count);
 
     if (!maintenance_mode)
-        init_data_module();
+        init_data_module(durability_policy, flush_interval);
+
+    if (metrics_enabled)
+        start_metrics_server();
 }
 
 static void init_info(void)
 {
     pid = getpid();
     mode = maintenance_mode ? "Maintenance" : "Default";
+    updates_source = webhook_mode ? "Webhook" : "Polling";
 }
 
 static void handle_signal(const int signal)
 {
     switch (signal)
     {
+        // The bot stops polling and drains, main() exits afterwards.
         case SIGTERM:
-            report("bolochagina-tgbot %d.%d.%d terminated (PID: %d; Mode: %s)",
-                   MAJOR_VERSION,
-                   MINOR_VERSION,
-                   PATCH_VERSION,
-                   pid,
-                   mode);
-            exit(EXIT_SUCCESS);
+            stop_bot();
+            break;
+
+        // The logs are reopened before the next record is written.
+        case SIGHUP:
+            reopen_log();
+            break;
 
         case SIGSEGV:
             die("Segmentation fault");
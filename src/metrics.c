@@ -0,0 +1,473 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "log.h"
+#include "http.h"
+#include "workers.h"
+#include "requests.h"
+#include "flood.h"
+#include "metrics.h"
+
+// The metrics are updated with relaxed atomics, so a scrape may see
+// the buckets of a histogram slightly ahead of its sum.
+typedef struct
+{
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_int_fast64_t sum;
+}
+HistogramData;
+
+typedef struct
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+}
+MetricsBuffer;
+
+static void *serve_metrics(void *arg);
+static void handle_metrics_request(const HttpRequest *request, HttpResponse *response, void *handler_arg);
+static void append_metrics(MetricsBuffer *buffer, const char *fmt, ...);
+static void append_metric(MetricsBuffer *buffer,
+                          const char *name,
+                          const char *type,
+                          const char *help,
+                          const uint_fast64_t value);
+static void append_histogram(MetricsBuffer *buffer,
+                             const char *name,
+                             const char *labels,
+                             HistogramData *histogram);
+static void append_stats(MetricsBuffer *buffer);
+static void add_histogram_value(HistogramData *histogram, const int_fast64_t value);
+static int get_histogram_bucket(const uint_fast64_t value);
+static uint_fast64_t get_histogram_bucket_bound(const int bucket);
+
+#define METRIC_NAME(id, name, ...) name,
+#define METRIC_HELP(id, name, help) help,
+#define API_METHOD_NAME(id, name) name,
+
+static const char *const counter_names[] = {COUNTERS(METRIC_NAME)};
+static const char *const counter_helps[] = {COUNTERS(METRIC_HELP)};
+static const char *const gauge_names[] = {GAUGES(METRIC_NAME)};
+static const char *const gauge_helps[] = {GAUGES(METRIC_HELP)};
+static const char *const histogram_names[] = {HISTOGRAMS(METRIC_NAME)};
+static const char *const histogram_helps[] = {HISTOGRAMS(METRIC_HELP)};
+static const char *const api_method_names[] = {API_METHODS(API_METHOD_NAME)};
+
+static atomic_uint_fast64_t counters[COUNTERS_COUNT];
+static atomic_int_fast64_t gauges[GAUGES_COUNT];
+static HistogramData histograms[HISTOGRAMS_COUNT];
+
+static HistogramData request_latencies[API_METHODS_COUNT];
+static atomic_uint_fast64_t request_retries[API_METHODS_COUNT];
+
+// The metrics are served on their own thread until the bot stops.
+void start_metrics_server(void)
+{
+    pthread_t metrics_thread;
+
+    if (pthread_create(&metrics_thread,
+                       NULL,
+                       serve_metrics,
+                       NULL))
+        die("%s: %s: failed to create metrics_thread",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_detach(metrics_thread);
+}
+
+void add_counter(const Counter counter, const uint_fast64_t value)
+{
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+void set_gauge(const Gauge gauge, const int_fast64_t value)
+{
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void record_histogram(const Histogram histogram, const int_fast64_t value)
+{
+    add_histogram_value(&histograms[histogram], value);
+}
+
+// Takes the method from the last path segment of a Bot API URL.
+ApiMethod get_api_method(const char *url)
+{
+    const char *method = strrchr(url, '/');
+
+    if (!method)
+        return API_METHOD_OTHER;
+
+    const size_t method_size = strcspn(++method, "?");
+
+    for (int i = 0; i < API_METHOD_OTHER; ++i)
+        if (strlen(api_method_names[i]) == method_size &&
+            !strncmp(method, api_method_names[i], method_size))
+            return i;
+
+    return API_METHOD_OTHER;
+}
+
+const char *get_api_method_name(const ApiMethod method)
+{
+    return api_method_names[method];
+}
+
+void record_request(const ApiMethod method, const int_fast64_t latency_us)
+{
+    add_histogram_value(&request_latencies[method], latency_us);
+}
+
+void count_request_retry(const ApiMethod method)
+{
+    atomic_fetch_add_explicit(&request_retries[method], 1, memory_order_relaxed);
+}
+
+static void *serve_metrics(void *arg)
+{
+    (void) arg;
+
+    run_http_server(METRICS_ADDRESS,
+                    METRICS_PORT,
+                    handle_metrics_request,
+                    NULL);
+
+    return NULL;
+}
+
+static void handle_metrics_request(const HttpRequest *request, HttpResponse *response, void *handler_arg)
+{
+    (void) handler_arg;
+
+    if (strcmp(request->path, METRICS_PATH))
+    {
+        response->status = 404;
+        return;
+    }
+
+    if (strcmp(request->method, "GET"))
+    {
+        response->status = 405;
+        return;
+    }
+
+    MetricsBuffer buffer;
+    buffer.data = malloc(INITIAL_METRICS_SIZE);
+
+    if (!buffer.data)
+        die("%s: %s: failed to allocate memory for buffer.data",
+            __BASE_FILE__,
+            __func__);
+
+    buffer.size = 0;
+    buffer.capacity = INITIAL_METRICS_SIZE;
+
+    for (int i = 0; i < COUNTERS_COUNT; ++i)
+        append_metric(&buffer,
+                      counter_names[i],
+                      "counter",
+                      counter_helps[i],
+                      atomic_load_explicit(&counters[i], memory_order_relaxed));
+
+    for (int i = 0; i < GAUGES_COUNT; ++i)
+        append_metric(&buffer,
+                      gauge_names[i],
+                      "gauge",
+                      gauge_helps[i],
+                      atomic_load_explicit(&gauges[i], memory_order_relaxed));
+
+    for (int i = 0; i < HISTOGRAMS_COUNT; ++i)
+    {
+        append_metrics(&buffer,
+                       "# HELP %s %s\n"
+                       "# TYPE %s histogram\n",
+                       histogram_names[i],
+                       histogram_helps[i],
+                       histogram_names[i]);
+        append_histogram(&buffer, histogram_names[i], "", &histograms[i]);
+    }
+
+    append_metrics(&buffer,
+                   "# HELP tgbot_request_latency_us Time of a Bot API request attempt in microseconds.\n"
+                   "# TYPE tgbot_request_latency_us histogram\n");
+
+    for (int i = 0; i < API_METHODS_COUNT; ++i)
+    {
+        char labels[64];
+        snprintf(labels, sizeof labels, "method=\"%s\"", api_method_names[i]);
+
+        append_histogram(&buffer, "tgbot_request_latency_us", labels, &request_latencies[i]);
+    }
+
+    append_metrics(&buffer,
+                   "# HELP tgbot_request_retries_total Bot API request attempts retried after a failure.\n"
+                   "# TYPE tgbot_request_retries_total counter\n");
+
+    for (int i = 0; i < API_METHODS_COUNT; ++i)
+        append_metrics(&buffer,
+                       "tgbot_request_retries_total{method=\"%s\"} %" PRIuFAST64 "\n",
+                       api_method_names[i],
+                       atomic_load_explicit(&request_retries[i], memory_order_relaxed));
+
+    append_stats(&buffer);
+
+    response->status = 200;
+    response->content_type = "text/plain; version=0.0.4; charset=utf-8";
+    response->body = buffer.data;
+    response->body_size = buffer.size;
+}
+
+static void append_metrics(MetricsBuffer *buffer, const char *fmt, ...)
+{
+    va_list args;
+
+    while (1)
+    {
+        va_start(args, fmt);
+        const int size = vsnprintf(buffer->data + buffer->size, buffer->capacity - buffer->size, fmt, args);
+        va_end(args);
+
+        if (size < 0)
+            die("%s: %s: failed to format metrics",
+                __BASE_FILE__,
+                __func__);
+
+        if ((size_t) size < buffer->capacity - buffer->size)
+        {
+            buffer->size += size;
+            return;
+        }
+
+        buffer->capacity *= 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+
+        if (!buffer->data)
+            die("%s: %s: failed to reallocate memory for buffer->data",
+                __BASE_FILE__,
+                __func__);
+    }
+}
+
+static void append_metric(MetricsBuffer *buffer,
+                          const char *name,
+                          const char *type,
+                          const char *help,
+                          const uint_fast64_t value)
+{
+    append_metrics(buffer,
+                   "# HELP %s %s\n"
+                   "# TYPE %s %s\n"
+                   "%s %" PRIuFAST64 "\n",
+                   name,
+                   help,
+                   name,
+                   type,
+                   name,
+                   value);
+}
+
+// The exported buckets are fixed, empty ones included, so the series do
+// not change between scrapes. The count is taken from all the buckets
+// so that it always matches the +Inf bucket.
+static void append_histogram(MetricsBuffer *buffer,
+                             const char *name,
+                             const char *labels,
+                             HistogramData *histogram)
+{
+    const char *separator = *labels ? "," : "";
+    uint_fast64_t count = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        count += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+
+        if (i >= HISTOGRAM_EXPORTED_BUCKETS || (i + 1) % HISTOGRAM_EXPORTED_STEP)
+            continue;
+
+        append_metrics(buffer,
+                       "%s_bucket{%s%sle=\"%" PRIuFAST64 "\"} %" PRIuFAST64 "\n",
+                       name,
+                       labels,
+                       separator,
+                       get_histogram_bucket_bound(i),
+                       count);
+    }
+
+    append_metrics(buffer,
+                   "%s_bucket{%s%sle=\"+Inf\"} %" PRIuFAST64 "\n"
+                   "%s_sum%s%s%s %" PRIdFAST64 "\n"
+                   "%s_count%s%s%s %" PRIuFAST64 "\n",
+                   name,
+                   labels,
+                   separator,
+                   count,
+                   name,
+                   *labels ? "{" : "",
+                   labels,
+                   *labels ? "}" : "",
+                   atomic_load_explicit(&histogram->sum, memory_order_relaxed),
+                   name,
+                   *labels ? "{" : "",
+                   labels,
+                   *labels ? "}" : "",
+                   count);
+}
+
+// The stats of the other modules are read at the scrape time.
+static void append_stats(MetricsBuffer *buffer)
+{
+    WorkersStats workers_stats;
+    QueueStats queue_stats;
+    ConnectionStats connection_stats;
+    FloodStats flood_stats;
+
+    get_workers_stats(&workers_stats);
+    get_queue_stats(&queue_stats);
+    get_connection_stats(&connection_stats);
+    get_flood_stats(&flood_stats);
+
+    append_metric(buffer,
+                  "tgbot_workers",
+                  "gauge",
+                  "Handler threads besides the priority one.",
+                  workers_stats.workers);
+    append_metric(buffer,
+                  "tgbot_busy_workers",
+                  "gauge",
+                  "Handler threads running an update now.",
+                  workers_stats.busy_workers);
+    append_metric(buffer,
+                  "tgbot_queued_works",
+                  "gauge",
+                  "Updates waiting in the worker queues.",
+                  workers_stats.queued_works);
+    append_metric(buffer,
+                  "tgbot_max_queued_works",
+                  "gauge",
+                  "Updates waiting in the longest worker queue.",
+                  workers_stats.max_queued_works);
+    append_metric(buffer,
+                  "tgbot_admitted_works",
+                  "gauge",
+                  "Admitted updates not finished yet.",
+                  workers_stats.admitted_works);
+    append_metric(buffer,
+                  "tgbot_completed_works_total",
+                  "counter",
+                  "Updates finished by the workers.",
+                  workers_stats.completed_works);
+    append_metric(buffer,
+                  "tgbot_blocked_submits_total",
+                  "counter",
+                  "Submits blocked by a full worker queue.",
+                  workers_stats.blocked_submits);
+    append_metric(buffer,
+                  "tgbot_shed_works_total",
+                  "counter",
+                  "Low-value updates shed under load.",
+                  workers_stats.shed_works);
+    append_metric(buffer,
+                  "tgbot_deferred_works_total",
+                  "counter",
+                  "Updates deferred under load.",
+                  workers_stats.deferred_works);
+    append_metric(buffer,
+                  "tgbot_priority_works_total",
+                  "counter",
+                  "Updates run by the priority worker.",
+                  workers_stats.priority_works);
+    append_metric(buffer,
+                  "tgbot_queued_requests",
+                  "gauge",
+                  "Bot API requests waiting in the queue.",
+                  queue_stats.queued_requests);
+    append_metric(buffer,
+                  "tgbot_active_requests",
+                  "gauge",
+                  "Bot API requests in flight.",
+                  queue_stats.active_requests);
+    append_metric(buffer,
+                  "tgbot_failed_requests_total",
+                  "counter",
+                  "Bot API requests failed after all retries.",
+                  queue_stats.failed_requests);
+    append_metric(buffer,
+                  "tgbot_throttled_requests_total",
+                  "counter",
+                  "Bot API requests delayed by the send rate limits.",
+                  queue_stats.throttled_requests);
+    append_metric(buffer,
+                  "tgbot_rate_limited_requests_total",
+                  "counter",
+                  "Bot API requests rejected by Telegram with 429.",
+                  queue_stats.rate_limited_requests);
+    append_metric(buffer,
+                  "tgbot_performed_requests_total",
+                  "counter",
+                  "Bot API request attempts performed.",
+                  connection_stats.performed_requests);
+    append_metric(buffer,
+                  "tgbot_new_connections_total",
+                  "counter",
+                  "Connections opened to the Bot API.",
+                  connection_stats.new_connections);
+    append_metric(buffer,
+                  "tgbot_reused_connections_total",
+                  "counter",
+                  "Bot API requests sent over a kept-alive connection.",
+                  connection_stats.reused_connections);
+    append_metric(buffer,
+                  "tgbot_flood_limited_updates_total",
+                  "counter",
+                  "Updates dropped by the flood limit.",
+                  flood_stats.limited_updates);
+    append_metric(buffer,
+                  "tgbot_flood_warned_chats_total",
+                  "counter",
+                  "Chats warned by the flood limit.",
+                  flood_stats.warned_chats);
+    append_metric(buffer,
+                  "tgbot_flood_evicted_chats_total",
+                  "counter",
+                  "Chats evicted from the flood table.",
+                  flood_stats.evicted_chats);
+}
+
+static void add_histogram_value(HistogramData *histogram, const int_fast64_t value)
+{
+    const uint_fast64_t bucket_value = value > 0 ? value : 0;
+
+    atomic_fetch_add_explicit(&histogram->buckets[get_histogram_bucket(bucket_value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, bucket_value, memory_order_relaxed);
+}
+
+static int get_histogram_bucket(const uint_fast64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    const int exponent = 63 - __builtin_clzll(value);
+
+    return (exponent - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+           ((value >> (exponent - HISTOGRAM_SUB_BUCKET_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Returns the largest value of the bucket, the Prometheus bounds are inclusive.
+static uint_fast64_t get_histogram_bucket_bound(const int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    const int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t sub_bucket = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+
+    // Wraps around to the max value for the last bucket.
+    return (sub_bucket << shift) + ((uint64_t) 1 << shift) - 1;
+}
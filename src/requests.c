@@ -1,12 +1,17 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include <curl/curl.h>
 #include <cjson/cJSON.h>
 
 #include "log.h"
+#include "metrics.h"
+#include "trace.h"
 #include "requests.h"
 
 typedef struct
@@ -16,25 +21,182 @@ typedef struct
 }
 ServerResponse;
 
+typedef struct Request
+{
+    CURL *curl;
+    const char *url;
+    ApiMethod method;
+    char *post_fields;
+    int_fast64_t chat_id;
+    int retries;
+    int throttled;
+    int_fast64_t not_before;
+    Trace *trace;
+    int_fast64_t queue_time;
+    int_fast64_t start_time;
+    ServerResponse response;
+    RequestCallback callback;
+    void *callback_arg;
+    struct Request *next;
+}
+Request;
+
+// The new message sent if the edited one is gone.
+typedef struct
+{
+    int_fast64_t chat_id;
+    char *post_fields;
+}
+ResentMessage;
+
+// Rate limits are kept as GCRA theoretical arrival times.
+// A chat whose arrival time has passed is idle and its slot can be reused.
+typedef struct
+{
+    int_fast64_t chat_id;
+    int_fast64_t arrival_time;
+}
+ChatLimit;
+
+static void resend_unedited_message(const long http_code, const char *response, void *resent_message);
+static void *process_requests(void *arg);
+static int start_queued_requests(void);
+static int finish_done_requests(void);
+static int is_chat_active(const int_fast64_t chat_id);
+static int is_chat_held(const int_fast64_t chat_id, const int_fast64_t *held_chats, const int held_chats_count);
+static ChatLimit *get_chat_limit(const int_fast64_t chat_id, const int_fast64_t now);
+static int_fast64_t get_retry_after(const char *response);
+static void requeue_request(Request *request);
+static int_fast64_t get_monotonic_time(void);
+static void setup_handle(CURL *curl);
+static CURL *acquire_handle(void);
+static void release_handle(CURL *curl);
+static CURLcode perform_request(CURL *curl, const ApiMethod method);
+static void count_connections(CURL *curl, const CURLcode code);
+static void record_request_time(CURL *curl, const ApiMethod method);
+static void lock_share(CURL *curl,
+                       curl_lock_data data,
+                       curl_lock_access access,
+                       void *userptr);
+static void unlock_share(CURL *curl, curl_lock_data data, void *userptr);
 static size_t write_callback(void *data,
                              const size_t data_size,
                              const size_t data_count,
                              void *server_response);
+static int progress_callback(void *arg,
+                             curl_off_t download_total,
+                             curl_off_t download_now,
+                             curl_off_t upload_total,
+                             curl_off_t upload_now);
+
+static CURLSH *share;
+static pthread_mutex_t share_mutexes[CURL_LOCK_DATA_LAST];
+
+// Idle handles keep their connections alive between requests.
+static CURL *idle_handles[MAX_CURL_HANDLES];
+static int idle_handles_count = 0;
+static int handles_count = 0;
+static pthread_mutex_t handles_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handles_cond = PTHREAD_COND_INITIALIZER;
+
+static atomic_uint_fast64_t performed_requests = 0;
+static atomic_uint_fast64_t new_connections = 0;
+static atomic_uint_fast64_t reused_connections = 0;
+
+static CURLM *multi;
+
+// Set from the signal handler to abort the long poll of getUpdates.
+static atomic_int updates_stopped = 0;
+
+static Request *queued_requests_head = NULL;
+static Request *queued_requests_tail = NULL;
+static int queued_requests_count = 0;
+static int queued_chatless_requests_count = 0;
+static pthread_mutex_t queued_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_requests_cond = PTHREAD_COND_INITIALIZER;
+
+// The requests thread is the only one draining the queue,
+// so the requests queued by its callbacks must not wait for room.
+static _Thread_local int queues_from_requests_thread = 0;
+
+// Only the requests thread touches the active requests and their handles.
+static Request *active_requests[MAX_ACTIVE_REQUESTS];
+static int active_requests_count = 0;
+static CURL *idle_multi_handles[MAX_ACTIVE_REQUESTS];
+static int idle_multi_handles_count = 0;
+
+static atomic_uint_fast64_t failed_requests = 0;
+
+// Only the requests thread touches the rate limits.
+static int_fast64_t global_arrival_time = 0;
+static ChatLimit chat_limits[MAX_CHAT_LIMITS];
+
+static atomic_uint_fast64_t throttled_requests = 0;
+static atomic_uint_fast64_t rate_limited_requests = 0;
 
 void init_requests_module(void)
 {
     curl_global_init(CURL_GLOBAL_DEFAULT);
-}
 
-cJSON *get_updates(const int_fast32_t update_id)
-{
-    CURL *curl = curl_easy_init();
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+        pthread_mutex_init(&share_mutexes[i], NULL);
+
+    if (!(share = curl_share_init()))
+        die("%s: %s: failed to initialize curl share",
+            __BASE_FILE__,
+            __func__);
+
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock_share);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock_share);
+    // libcurl does not support sharing the connection cache between threads,
+    // so the pooled handles and the multi handle keep their own connections.
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    if (!(multi = curl_multi_init()))
+        die("%s: %s: failed to initialize curl multi",
+            __BASE_FILE__,
+            __func__);
+
+    pthread_t process_requests_thread;
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (pthread_create(&process_requests_thread,
+                       NULL,
+                       process_requests,
+                       NULL))
+        die("%s: %s: failed to create process_requests_thread",
             __BASE_FILE__,
             __func__);
 
+    pthread_detach(process_requests_thread);
+}
+
+void get_connection_stats(ConnectionStats *stats)
+{
+    stats->performed_requests = atomic_load(&performed_requests);
+    stats->new_connections = atomic_load(&new_connections);
+    stats->reused_connections = atomic_load(&reused_connections);
+}
+
+void get_queue_stats(QueueStats *stats)
+{
+    pthread_mutex_lock(&queued_requests_mutex);
+
+    stats->queued_requests = queued_requests_count;
+    stats->active_requests = active_requests_count;
+
+    pthread_mutex_unlock(&queued_requests_mutex);
+
+    stats->failed_requests = atomic_load(&failed_requests);
+    stats->throttled_requests = atomic_load(&throttled_requests);
+    stats->rate_limited_requests = atomic_load(&rate_limited_requests);
+}
+
+// The updates are parsed into the arena and freed together with it.
+cJSON *get_updates(const int_fast32_t update_id, Arena *arena)
+{
+    CURL *curl = acquire_handle();
+
     ServerResponse response;
     response.data = malloc(1);
 
@@ -57,22 +219,16 @@ cJSON *get_updates(const int_fast32_t update_id)
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
 
-    CURLcode code;
-    int retries = 0;
+    const int_fast64_t poll_time = get_monotonic_time();
+    const CURLcode code = perform_request(curl, API_METHOD_GET_UPDATES);
 
-    do
-    {
-        code = curl_easy_perform(curl);
-
-        if (code == CURLE_OK)
-            break;
-    }
-    while (++retries < MAX_REQUEST_RETRIES);
+    record_histogram(HISTOGRAM_POLL_LATENCY, get_monotonic_time() - poll_time);
 
-    curl_easy_cleanup(curl);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+    release_handle(curl);
 
     if (code != CURLE_OK)
     {
@@ -80,7 +236,9 @@ cJSON *get_updates(const int_fast32_t update_id)
         return NULL;
     }
 
+    use_arena(arena);
     cJSON *updates = cJSON_Parse(response.data);
+    use_arena(NULL);
 
     if (!updates)
         die("%s: %s: failed to parse response.data",
@@ -91,106 +249,784 @@ cJSON *get_updates(const int_fast32_t update_id)
     return updates;
 }
 
+// Only sets a flag, so it is safe to call from a signal handler.
+void stop_updates(void)
+{
+    atomic_store(&updates_stopped, 1);
+}
+
+void queue_request(const char *url,
+                   const int_fast64_t chat_id,
+                   char *post_fields,
+                   RequestCallback callback,
+                   void *callback_arg)
+{
+    const int_fast64_t span_start = begin_span();
+    Request *request = malloc(sizeof *request);
+
+    if (!request)
+        die("%s: %s: failed to allocate memory for request",
+            __BASE_FILE__,
+            __func__);
+
+    request->curl = NULL;
+    request->url = url;
+    request->method = get_api_method(url);
+    request->post_fields = post_fields;
+    request->chat_id = chat_id;
+    request->retries = 0;
+    request->throttled = 0;
+    request->not_before = 0;
+    request->trace = get_current_trace();
+    request->queue_time = request->trace ? get_monotonic_time() : 0;
+    request->start_time = 0;
+    request->response.data = NULL;
+    request->response.size = 0;
+    request->callback = callback;
+    request->callback_arg = callback_arg;
+    request->next = NULL;
+
+    // The request keeps the trace open until it is completed.
+    retain_trace(request->trace);
+
+    pthread_mutex_lock(&queued_requests_mutex);
+
+    // Requeued requests and callbacks may push the count over the limit.
+    while (!queues_from_requests_thread && queued_requests_count >= MAX_QUEUED_REQUESTS)
+        pthread_cond_wait(&queued_requests_cond, &queued_requests_mutex);
+
+    if (queued_requests_tail)
+        queued_requests_tail->next = request;
+    else
+        queued_requests_head = request;
+
+    queued_requests_tail = request;
+    ++queued_requests_count;
+
+    if (!chat_id)
+        ++queued_chatless_requests_count;
+
+    pthread_mutex_unlock(&queued_requests_mutex);
+
+    curl_multi_wakeup(multi);
+
+    end_span("queue_request", span_start);
+}
+
 void leave_chat(const int_fast64_t chat_id)
 {
-    CURL *curl = curl_easy_init();
+    char *post_fields = malloc(MAX_POSTFIELDS_SIZE);
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (!post_fields)
+        die("%s: %s: failed to allocate memory for post_fields",
             __BASE_FILE__,
             __func__);
 
-    char post_fields[MAX_POSTFIELDS_SIZE];
     snprintf(post_fields,
-             sizeof post_fields,
+             MAX_POSTFIELDS_SIZE,
              "chat_id=%" PRIdFAST64,
              chat_id);
 
-    curl_easy_setopt(curl, CURLOPT_URL, BOT_API_URL "/leaveChat");
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
+    queue_request(BOT_API_URL "/leaveChat",
+                  chat_id,
+                  post_fields,
+                  NULL,
+                  NULL);
+}
 
-    int retries = 0;
+void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard)
+{
+    char *escaped_message = curl_easy_escape(NULL, message, 0);
 
-    do
-        if (curl_easy_perform(curl) == CURLE_OK)
-            break;
-    while (++retries < MAX_REQUEST_RETRIES);
+    if (!escaped_message)
+        die("%s: %s: failed to escape message",
+            __BASE_FILE__,
+            __func__);
+
+    // Escaped pages of questions are longer than the usual messages.
+    const size_t post_fields_size = MAX_POSTFIELDS_SIZE + strlen(escaped_message) + strlen(keyboard);
+    char *post_fields = malloc(post_fields_size);
 
-    curl_easy_cleanup(curl);
+    if (!post_fields)
+        die("%s: %s: failed to allocate memory for post_fields",
+            __BASE_FILE__,
+            __func__);
+
+    snprintf(post_fields,
+             post_fields_size,
+             "chat_id=%" PRIdFAST64
+             "&text=%s"
+             "&reply_markup=%s",
+             chat_id,
+             escaped_message,
+             keyboard);
+
+    curl_free(escaped_message);
+
+    queue_request(BOT_API_URL "/sendMessage",
+                  chat_id,
+                  post_fields,
+                  NULL,
+                  NULL);
 }
 
-void send_message_with_keyboard(const int_fast64_t chat_id, const char *message, const char *keyboard)
+// An empty value is left out, so Telegram uses its default.
+void encode_fields(EncodedFields *fields, const char *name, const char *value)
+{
+    if (!*value)
+    {
+        fields->fields = "";
+        fields->fields_size = 0;
+        return;
+    }
+
+    char *escaped_value = curl_easy_escape(NULL, value, 0);
+
+    if (!escaped_value)
+        die("%s: %s: failed to escape %s",
+            __BASE_FILE__,
+            __func__,
+            name);
+
+    const size_t fields_size = strlen(name) + strlen(escaped_value) + 2;
+    char *encoded_fields = malloc(fields_size + 1);
+
+    if (!encoded_fields)
+        die("%s: %s: failed to allocate memory for encoded_fields",
+            __BASE_FILE__,
+            __func__);
+
+    snprintf(encoded_fields,
+             fields_size + 1,
+             "&%s=%s",
+             name,
+             escaped_value);
+
+    curl_free(escaped_value);
+
+    fields->fields = encoded_fields;
+    fields->fields_size = fields_size;
+}
+
+// The encoded fields are only copied after the chat_id, the text is not
+// escaped or formatted again.
+void send_encoded_message(const int_fast64_t chat_id,
+                          const EncodedFields *message,
+                          const EncodedFields *keyboard)
 {
-    CURL *curl = curl_easy_init();
+    const size_t post_fields_size = sizeof "chat_id=-9223372036854775808" +
+                                    message->fields_size +
+                                    keyboard->fields_size;
+    char *post_fields = malloc(post_fields_size);
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (!post_fields)
+        die("%s: %s: failed to allocate memory for post_fields",
             __BASE_FILE__,
             __func__);
 
-    char *escaped_message = curl_easy_escape(curl, message, 0);
+    char *end = post_fields + snprintf(post_fields,
+                                       post_fields_size,
+                                       "chat_id=%" PRIdFAST64,
+                                       chat_id);
+
+    memcpy(end, message->fields, message->fields_size);
+    end += message->fields_size;
+    memcpy(end, keyboard->fields, keyboard->fields_size);
+    end[keyboard->fields_size] = '\0';
+
+    queue_request(BOT_API_URL "/sendMessage",
+                  chat_id,
+                  post_fields,
+                  NULL,
+                  NULL);
+}
+
+void edit_message_with_keyboard(const int_fast64_t chat_id,
+                                const int_fast64_t message_id,
+                                const char *message,
+                                const char *keyboard)
+{
+    char *escaped_message = curl_easy_escape(NULL, message, 0);
 
     if (!escaped_message)
         die("%s: %s: failed to escape message",
             __BASE_FILE__,
             __func__);
 
-    char post_fields[MAX_POSTFIELDS_SIZE];
+    const size_t post_fields_size = MAX_POSTFIELDS_SIZE + strlen(escaped_message) + strlen(keyboard);
+    char *post_fields = malloc(post_fields_size);
+
+    if (!post_fields)
+        die("%s: %s: failed to allocate memory for post_fields",
+            __BASE_FILE__,
+            __func__);
+
+    ResentMessage *resent_message = malloc(sizeof *resent_message);
+
+    if (!resent_message || !(resent_message->post_fields = malloc(post_fields_size)))
+        die("%s: %s: failed to allocate memory for resent_message",
+            __BASE_FILE__,
+            __func__);
+
     snprintf(post_fields,
-             sizeof post_fields,
+             post_fields_size,
              "chat_id=%" PRIdFAST64
+             "&message_id=%" PRIdFAST64
              "&text=%s"
              "&reply_markup=%s",
              chat_id,
+             message_id,
              escaped_message,
              keyboard);
 
-    curl_easy_setopt(curl, CURLOPT_URL, BOT_API_URL "/sendMessage");
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
-
-    int retries = 0;
-
-    do
-        if (curl_easy_perform(curl) == CURLE_OK)
-            break;
-    while (++retries < MAX_REQUEST_RETRIES);
+    resent_message->chat_id = chat_id;
+    snprintf(resent_message->post_fields,
+             post_fields_size,
+             "chat_id=%" PRIdFAST64
+             "&text=%s"
+             "&reply_markup=%s",
+             chat_id,
+             escaped_message,
+             keyboard);
 
     curl_free(escaped_message);
-    curl_easy_cleanup(curl);
+
+    queue_request(BOT_API_URL "/editMessageText",
+                  chat_id,
+                  post_fields,
+                  resend_unedited_message,
+                  resent_message);
 }
 
 void answer_callback_query(const char *callback_query_id)
 {
-    CURL *curl = curl_easy_init();
+    char *post_fields = malloc(MAX_POSTFIELDS_SIZE);
 
-    if (!curl)
-        die("%s: %s: failed to initialize curl",
+    if (!post_fields)
+        die("%s: %s: failed to allocate memory for post_fields",
             __BASE_FILE__,
             __func__);
 
-    char post_fields[MAX_POSTFIELDS_SIZE];
     snprintf(post_fields,
-             sizeof post_fields,
+             MAX_POSTFIELDS_SIZE,
              "callback_query_id=%s",
              callback_query_id);
 
-    curl_easy_setopt(curl, CURLOPT_URL, BOT_API_URL "/answerCallbackQuery");
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
+    queue_request(BOT_API_URL "/answerCallbackQuery",
+                  0,
+                  post_fields,
+                  NULL,
+                  NULL);
+}
+
+// A message that cannot be edited anymore, for example a deleted or
+// an old one, is sent again as a new message. An unchanged one is kept.
+static void resend_unedited_message(const long http_code, const char *response, void *resent_message)
+{
+    ResentMessage *message = resent_message;
+
+    if (http_code == 400 && !strstr(response, "message is not modified"))
+        queue_request(BOT_API_URL "/sendMessage",
+                      message->chat_id,
+                      message->post_fields,
+                      NULL,
+                      NULL);
+    else
+        free(message->post_fields);
+
+    free(message);
+}
+
+static void *process_requests(void *arg)
+{
+    (void) arg;
+
+    queues_from_requests_thread = 1;
+
+    for (;;)
+    {
+        const int timeout = start_queued_requests();
+
+        int running_handles;
+        curl_multi_perform(multi, &running_handles);
+
+        // Completed requests may unblock queued ones, so look at the queue again.
+        if (finish_done_requests())
+            continue;
+
+        curl_multi_poll(multi,
+                        NULL,
+                        0,
+                        timeout,
+                        NULL);
+    }
+
+    return NULL;
+}
+
+static int start_queued_requests(void)
+{
+    const int_fast64_t now = get_monotonic_time();
+    int_fast64_t wakeup_time = now + MAX_POLL_TIMEOUT_MS * 1000;
+    int_fast64_t global_allowed_time = global_arrival_time - GLOBAL_SEND_INTERVAL_US * (GLOBAL_SEND_BURST - 1);
+
+    Request *started_requests = NULL;
+
+    pthread_mutex_lock(&queued_requests_mutex);
+
+    Request *previous = NULL;
+    Request *request = queued_requests_head;
+    int chatless_requests_left = queued_chatless_requests_count;
+
+    // Chats whose request waits for retry_after, their later requests
+    // must not overtake it. If there are too many, all chats are held.
+    int_fast64_t held_chats[MAX_ACTIVE_REQUESTS];
+    int held_chats_count = 0;
+    int held_chats_full = 0;
+
+    // A chat gets its next request only when the previous one is completed,
+    // so messages are delivered in the order they were queued.
+    // Requests over the rate limits stay queued until they are allowed.
+    while (request && active_requests_count < MAX_ACTIVE_REQUESTS)
+    {
+        // No chat request can start over the global limit,
+        // so the rest of the queue is walked only for chat-less requests.
+        if (global_allowed_time > now && !chatless_requests_left)
+            break;
+
+        Request *next = request->next;
+
+        if (!request->chat_id)
+            --chatless_requests_left;
+
+        // A request rejected with retry_after waits until it passes.
+        if (request->not_before > now)
+        {
+            if (request->not_before < wakeup_time)
+                wakeup_time = request->not_before;
+
+            if (request->chat_id)
+            {
+                if (held_chats_count < MAX_ACTIVE_REQUESTS)
+                    held_chats[held_chats_count++] = request->chat_id;
+                else
+                    held_chats_full = 1;
+            }
+
+            previous = request;
+            request = next;
+            continue;
+        }
+
+        if (request->chat_id)
+        {
+            if (global_allowed_time <= now &&
+                (held_chats_full ||
+                 is_chat_held(request->chat_id, held_chats, held_chats_count) ||
+                 is_chat_active(request->chat_id)))
+            {
+                previous = request;
+                request = next;
+                continue;
+            }
+
+            ChatLimit *chat_limit = global_allowed_time > now ? NULL : get_chat_limit(request->chat_id, now);
+
+            const int_fast64_t allowed_time = chat_limit ?
+                                              chat_limit->arrival_time - CHAT_SEND_INTERVAL_US * (CHAT_SEND_BURST - 1) :
+                                              now + CHAT_SEND_INTERVAL_US;
+
+            if (global_allowed_time > now || allowed_time > now)
+            {
+                if (!request->throttled)
+                {
+                    request->throttled = 1;
+                    atomic_fetch_add(&throttled_requests, 1);
+                }
+
+                if (global_allowed_time <= now && allowed_time < wakeup_time)
+                    wakeup_time = allowed_time;
+
+                previous = request;
+                request = next;
+                continue;
+            }
+
+            chat_limit->chat_id = request->chat_id;
+            chat_limit->arrival_time = (chat_limit->arrival_time > now ? chat_limit->arrival_time : now) +
+                                       CHAT_SEND_INTERVAL_US;
+
+            global_arrival_time = (global_arrival_time > now ? global_arrival_time : now) +
+                                  GLOBAL_SEND_INTERVAL_US;
+            global_allowed_time = global_arrival_time - GLOBAL_SEND_INTERVAL_US * (GLOBAL_SEND_BURST - 1);
+        }
+        else
+            --queued_chatless_requests_count;
+
+        if (previous)
+            previous->next = next;
+        else
+            queued_requests_head = next;
+
+        if (queued_requests_tail == request)
+            queued_requests_tail = previous;
+
+        --queued_requests_count;
+
+        active_requests[active_requests_count++] = request;
+
+        request->next = started_requests;
+        started_requests = request;
+
+        request = next;
+    }
+
+    if (global_allowed_time > now && global_allowed_time < wakeup_time &&
+        queued_requests_count > queued_chatless_requests_count)
+        wakeup_time = global_allowed_time;
+
+    if (started_requests)
+        pthread_cond_broadcast(&queued_requests_cond);
+
+    pthread_mutex_unlock(&queued_requests_mutex);
+
+    while (started_requests)
+    {
+        request = started_requests;
+        started_requests = request->next;
+        request->next = NULL;
+
+        if (idle_multi_handles_count)
+            request->curl = idle_multi_handles[--idle_multi_handles_count];
+        else if (!(request->curl = curl_easy_init()))
+            die("%s: %s: failed to initialize curl",
+                __BASE_FILE__,
+                __func__);
+
+        setup_handle(request->curl);
+
+        curl_easy_setopt(request->curl, CURLOPT_URL, request->url);
+        curl_easy_setopt(request->curl, CURLOPT_POSTFIELDS, request->post_fields);
+        curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, &request->response);
+        curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
+
+        if (request->trace)
+            request->start_time = get_monotonic_time();
+
+        curl_multi_add_handle(multi, request->curl);
+    }
+
+    return (wakeup_time - now + 999) / 1000;
+}
+
+static int finish_done_requests(void)
+{
+    int finished_requests = 0;
+
+    CURLMsg *message;
+    int messages_left;
+
+    while ((message = curl_multi_info_read(multi, &messages_left)))
+    {
+        if (message->msg != CURLMSG_DONE)
+            continue;
+
+        ++finished_requests;
+
+        CURL *curl = message->easy_handle;
+        const CURLcode code = message->data.result;
+
+        Request *request;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+
+        atomic_fetch_add(&performed_requests, 1);
+        count_connections(curl, code);
+        record_request_time(curl, request->method);
+
+        curl_multi_remove_handle(multi, curl);
+
+        if (code != CURLE_OK && ++request->retries < MAX_REQUEST_RETRIES)
+        {
+            count_request_retry(request->method);
+            request->response.size = 0;
+            curl_multi_add_handle(multi, curl);
+            continue;
+        }
+
+        long http_code = 0;
+
+        if (code == CURLE_OK)
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        else
+            atomic_fetch_add(&failed_requests, 1);
+
+        const int_fast64_t retry_after = http_code == 429 ? get_retry_after(request->response.data) : 0;
+
+        pthread_mutex_lock(&queued_requests_mutex);
+
+        for (int i = 0; i < active_requests_count; ++i)
+            if (active_requests[i] == request)
+            {
+                active_requests[i] = active_requests[--active_requests_count];
+                break;
+            }
+
+        pthread_mutex_unlock(&queued_requests_mutex);
+
+        if (retry_after)
+        {
+            atomic_fetch_add(&rate_limited_requests, 1);
+
+            const int_fast64_t now = get_monotonic_time();
+            ChatLimit *chat_limit = request->chat_id ? get_chat_limit(request->chat_id, now) : NULL;
+
+            // The request waits for retry_after even when its chat has no free limit slot,
+            // the later requests of its chat are held back until it is started again.
+            request->not_before = now + retry_after * 1000000;
+
+            if (chat_limit)
+            {
+                chat_limit->chat_id = request->chat_id;
+                chat_limit->arrival_time = request->not_before +
+                                           CHAT_SEND_INTERVAL_US * (CHAT_SEND_BURST - 1);
+            }
+
+            curl_easy_reset(curl);
+            idle_multi_handles[idle_multi_handles_count++] = curl;
+
+            request->curl = NULL;
+            request->response.size = 0;
+            requeue_request(request);
+            continue;
+        }
+
+        // The queue span also covers the time spent rate limited.
+        if (request->trace)
+        {
+            add_trace_span(request->trace, "request_queue", request->queue_time, request->start_time);
+            add_trace_span(request->trace,
+                           get_api_method_name(request->method),
+                           request->start_time,
+                           get_monotonic_time());
+        }
+
+        // The requests queued by the callback belong to the same trace.
+        set_current_trace(request->trace);
+
+        if (request->callback)
+            request->callback(http_code,
+                              request->response.data ? request->response.data : "",
+                              request->callback_arg);
+
+        set_current_trace(NULL);
+        release_trace(request->trace);
+
+        curl_easy_reset(curl);
+        idle_multi_handles[idle_multi_handles_count++] = curl;
+
+        free(request->response.data);
+        free(request->post_fields);
+        free(request);
+    }
+
+    return finished_requests;
+}
+
+static int is_chat_active(const int_fast64_t chat_id)
+{
+    for (int i = 0; i < active_requests_count; ++i)
+        if (active_requests[i]->chat_id == chat_id)
+            return 1;
+
+    return 0;
+}
+
+static int is_chat_held(const int_fast64_t chat_id, const int_fast64_t *held_chats, const int held_chats_count)
+{
+    for (int i = 0; i < held_chats_count; ++i)
+        if (held_chats[i] == chat_id)
+            return 1;
+
+    return 0;
+}
+
+static ChatLimit *get_chat_limit(const int_fast64_t chat_id, const int_fast64_t now)
+{
+    ChatLimit *idle_chat_limit = NULL;
+    size_t index = (uint_fast64_t) chat_id * 0x9E3779B97F4A7C15 % MAX_CHAT_LIMITS;
+
+    for (int i = 0; i < MAX_CHAT_LIMIT_PROBES; ++i)
+    {
+        ChatLimit *chat_limit = &chat_limits[index];
+
+        if (chat_limit->chat_id == chat_id)
+            return chat_limit;
+
+        if (!idle_chat_limit && chat_limit->arrival_time <= now)
+            idle_chat_limit = chat_limit;
+
+        index = (index + 1) % MAX_CHAT_LIMITS;
+    }
+
+    if (idle_chat_limit)
+    {
+        idle_chat_limit->chat_id = chat_id;
+        idle_chat_limit->arrival_time = now;
+    }
+
+    return idle_chat_limit;
+}
+
+static int_fast64_t get_retry_after(const char *response)
+{
+    if (!response)
+        return 0;
+
+    cJSON *error = cJSON_Parse(response);
+
+    const cJSON *retry_after = cJSON_GetObjectItem(cJSON_GetObjectItem(error, "parameters"), "retry_after");
+    const int_fast64_t seconds = cJSON_IsNumber(retry_after) && retry_after->valueint > 0 ? retry_after->valueint : 1;
+
+    cJSON_Delete(error);
+    return seconds;
+}
+
+static void requeue_request(Request *request)
+{
+    pthread_mutex_lock(&queued_requests_mutex);
+
+    request->next = queued_requests_head;
+    queued_requests_head = request;
+
+    if (!queued_requests_tail)
+        queued_requests_tail = request;
+
+    ++queued_requests_count;
+
+    if (!request->chat_id)
+        ++queued_chatless_requests_count;
+
+    pthread_mutex_unlock(&queued_requests_mutex);
+}
+
+static int_fast64_t get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int_fast64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static void setup_handle(CURL *curl)
+{
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, MAX_CONNECT_TIMEOUT);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, MAX_RESPONSE_TIMEOUT);
+}
 
+static CURL *acquire_handle(void)
+{
+    pthread_mutex_lock(&handles_mutex);
+
+    while (!idle_handles_count && handles_count == MAX_CURL_HANDLES)
+        pthread_cond_wait(&handles_cond, &handles_mutex);
+
+    CURL *curl;
+
+    if (idle_handles_count)
+        curl = idle_handles[--idle_handles_count];
+    else
+    {
+        if (!(curl = curl_easy_init()))
+            die("%s: %s: failed to initialize curl",
+                __BASE_FILE__,
+                __func__);
+
+        ++handles_count;
+    }
+
+    pthread_mutex_unlock(&handles_mutex);
+
+    setup_handle(curl);
+    return curl;
+}
+
+static void release_handle(CURL *curl)
+{
+    // Resetting the options keeps the connection and the caches of the handle.
+    curl_easy_reset(curl);
+
+    pthread_mutex_lock(&handles_mutex);
+
+    idle_handles[idle_handles_count++] = curl;
+
+    pthread_cond_signal(&handles_cond);
+    pthread_mutex_unlock(&handles_mutex);
+}
+
+static CURLcode perform_request(CURL *curl, const ApiMethod method)
+{
+    CURLcode code;
     int retries = 0;
 
     do
-        if (curl_easy_perform(curl) == CURLE_OK)
+    {
+        code = curl_easy_perform(curl);
+
+        atomic_fetch_add(&performed_requests, 1);
+        count_connections(curl, code);
+        record_request_time(curl, method);
+
+        if (code == CURLE_OK || code == CURLE_ABORTED_BY_CALLBACK)
             break;
+
+        count_request_retry(method);
+    }
     while (++retries < MAX_REQUEST_RETRIES);
 
-    curl_easy_cleanup(curl);
+    return code;
+}
+
+static void count_connections(CURL *curl, const CURLcode code)
+{
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    if (connects)
+        atomic_fetch_add(&new_connections, connects);
+    else if (code == CURLE_OK)
+        atomic_fetch_add(&reused_connections, 1);
+}
+
+static void record_request_time(CURL *curl, const ApiMethod method)
+{
+    curl_off_t total_time = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total_time);
+
+    record_request(method, total_time);
+}
+
+static void lock_share(CURL *curl,
+                       curl_lock_data data,
+                       curl_lock_access access,
+                       void *userptr)
+{
+    (void) curl;
+    (void) access;
+    (void) userptr;
+
+    pthread_mutex_lock(&share_mutexes[data]);
+}
+
+static void unlock_share(CURL *curl, curl_lock_data data, void *userptr)
+{
+    (void) curl;
+    (void) userptr;
+
+    pthread_mutex_unlock(&share_mutexes[data]);
 }
 
 static size_t write_callback(void *data,
@@ -215,3 +1051,19 @@ static size_t write_callback(void *data,
 
     return data_real_size;
 }
+
+// Called at least once a second, so a stop request is noticed quickly.
+static int progress_callback(void *arg,
+                             curl_off_t download_total,
+                             curl_off_t download_now,
+                             curl_off_t upload_total,
+                             curl_off_t upload_now)
+{
+    (void) arg;
+    (void) download_total;
+    (void) download_now;
+    (void) upload_total;
+    (void) upload_now;
+
+    return atomic_load(&updates_stopped);
+}
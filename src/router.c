@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "log.h"
+#include "router.h"
+
+static int lookup_route(const Router *router, const char *key, const size_t key_size);
+static uint32_t hash_key(const uint32_t seed, const char *key, const size_t key_size);
+
+// Searches for a seed that puts every key into its own slot, so a lookup
+// hashes the input once and compares it with a single key.
+void init_router(Router *router,
+                 const char *const *keys,
+                 const int *prefixes,
+                 const size_t keys_count)
+{
+    if (keys_count > MAX_ROUTES)
+        die("%s: %s: too many routes",
+            __BASE_FILE__,
+            __func__);
+
+    router->keys = keys;
+    router->prefixes = prefixes;
+
+    for (size_t i = 0; i < keys_count; ++i)
+    {
+        router->key_sizes[i] = strlen(keys[i]);
+
+        const size_t prefix_size = strspn(keys[i], ROUTE_PREFIX_CHARS);
+
+        if (prefixes[i] &&
+            (!prefix_size ||
+             (keys[i][prefix_size] && strcmp(keys[i] + prefix_size, ":"))))
+            die("%s: %s: invalid prefix route %s",
+                __BASE_FILE__,
+                __func__,
+                keys[i]);
+    }
+
+    for (uint32_t seed = 0; seed < MAX_ROUTER_SEEDS; ++seed)
+    {
+        memset(router->slots, 0, sizeof router->slots);
+
+        size_t placed = 0;
+
+        while (placed < keys_count)
+        {
+            uint8_t *slot = &router->slots[hash_key(seed, keys[placed], router->key_sizes[placed]) % ROUTER_SLOTS];
+
+            if (*slot)
+                break;
+
+            *slot = placed + 1;
+            ++placed;
+        }
+
+        if (placed == keys_count)
+        {
+            router->seed = seed;
+            return;
+        }
+    }
+
+    die("%s: %s: failed to find a perfect hash for the routes",
+        __BASE_FILE__,
+        __func__);
+}
+
+// Returns the index of the matched key or -1. The input after the matched
+// prefix is returned in arg, exact routes get an empty arg.
+int find_route(const Router *router, const char *input, const char **arg)
+{
+    const size_t input_size = strlen(input);
+    int route = lookup_route(router, input, input_size);
+
+    if (route >= 0 && !router->prefixes[route])
+    {
+        *arg = input + input_size;
+        return route;
+    }
+
+    size_t prefix_size = strspn(input, ROUTE_PREFIX_CHARS);
+
+    if (input[prefix_size] == ':')
+        ++prefix_size;
+
+    route = lookup_route(router, input, prefix_size);
+
+    if (route >= 0 && router->prefixes[route])
+    {
+        *arg = input + prefix_size;
+        return route;
+    }
+
+    return -1;
+}
+
+static int lookup_route(const Router *router, const char *key, const size_t key_size)
+{
+    if (!key_size)
+        return -1;
+
+    const int route = router->slots[hash_key(router->seed, key, key_size) % ROUTER_SLOTS] - 1;
+
+    if (route < 0 ||
+        router->key_sizes[route] != key_size ||
+        memcmp(router->keys[route], key, key_size))
+        return -1;
+
+    return route;
+}
+
+// FNV-1a with the seed mixed into the offset basis. The low bits of FNV
+// depend only on the low bits of the input, so the result is mixed down.
+static uint32_t hash_key(const uint32_t seed, const char *key, const size_t key_size)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (size_t i = 0; i < key_size; ++i)
+    {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+
+    return hash;
+}
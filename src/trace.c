@@ -0,0 +1,227 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "log.h"
+#include "trace.h"
+
+typedef struct
+{
+    const char *name;
+    int depth;
+    int_fast64_t start;
+    int_fast64_t end;
+}
+TraceSpan;
+
+// The worker and the requests thread add spans while they hold a reference,
+// so the spans are complete once the last reference is released.
+struct Trace
+{
+    int_fast64_t update_id;
+    int_fast64_t chat_id;
+    int_fast64_t start_time;
+    atomic_int references;
+    atomic_int spans_count;
+    TraceSpan spans[MAX_TRACE_SPANS];
+};
+
+static void add_span(Trace *trace,
+                     const char *name,
+                     const int depth,
+                     const int_fast64_t span_start,
+                     const int_fast64_t span_end);
+static void write_trace(Trace *trace);
+static int format_spans(char *text, const size_t text_size, Trace *trace);
+static int compare_spans(const void *a, const void *b);
+static int_fast64_t get_monotonic_time(void);
+
+// Tracing is off while the threshold is 0.
+static int_fast64_t trace_threshold = 0;
+
+static _Thread_local Trace *current_trace = NULL;
+static _Thread_local int span_depth = 0;
+
+void init_trace_module(const int threshold_ms)
+{
+    trace_threshold = (int_fast64_t) threshold_ms * 1000;
+}
+
+// Returns NULL if tracing is off, the other functions ignore NULL traces.
+Trace *start_trace(const int_fast64_t update_id, const int_fast64_t chat_id)
+{
+    if (!trace_threshold)
+        return NULL;
+
+    Trace *trace = malloc(sizeof *trace);
+
+    if (!trace)
+        die("%s: %s: failed to allocate memory for trace",
+            __BASE_FILE__,
+            __func__);
+
+    trace->update_id = update_id;
+    trace->chat_id = chat_id;
+    trace->start_time = get_monotonic_time();
+    atomic_init(&trace->references, 1);
+    atomic_init(&trace->spans_count, 0);
+
+    return trace;
+}
+
+void retain_trace(Trace *trace)
+{
+    if (trace)
+        atomic_fetch_add(&trace->references, 1);
+}
+
+// The last release writes the trace if it took longer than the threshold.
+void release_trace(Trace *trace)
+{
+    if (!trace || atomic_fetch_sub(&trace->references, 1) != 1)
+        return;
+
+    if (get_monotonic_time() - trace->start_time >= trace_threshold)
+        write_trace(trace);
+
+    free(trace);
+}
+
+// The spans of the thread are added to its current trace.
+void set_current_trace(Trace *trace)
+{
+    current_trace = trace;
+    span_depth = 0;
+}
+
+Trace *get_current_trace(void)
+{
+    return current_trace;
+}
+
+// Returns 0 without a current trace, so an untraced span costs one check.
+int_fast64_t begin_span(void)
+{
+    if (!current_trace)
+        return 0;
+
+    ++span_depth;
+    return get_monotonic_time();
+}
+
+void end_span(const char *name, const int_fast64_t span_start)
+{
+    if (!span_start)
+        return;
+
+    add_span(current_trace, name, --span_depth, span_start, get_monotonic_time());
+}
+
+void add_trace_span(Trace *trace,
+                    const char *name,
+                    const int_fast64_t span_start,
+                    const int_fast64_t span_end)
+{
+    if (trace)
+        add_span(trace, name, 0, span_start, span_end);
+}
+
+static void add_span(Trace *trace,
+                     const char *name,
+                     const int depth,
+                     const int_fast64_t span_start,
+                     const int_fast64_t span_end)
+{
+    const int index = atomic_fetch_add(&trace->spans_count, 1);
+
+    if (index >= MAX_TRACE_SPANS)
+        return;
+
+    TraceSpan *span = &trace->spans[index];
+
+    span->name = name;
+    span->depth = depth;
+    span->start = span_start;
+    span->end = span_end;
+}
+
+static void write_trace(Trace *trace)
+{
+    char spans[MAX_TRACE_SPANS_SIZE];
+    const int written_spans = format_spans(spans, sizeof spans, trace);
+
+    log_trace("slow_update",
+              (const LogField[])
+              {
+                  LOG_INT("update_id", trace->update_id),
+                  LOG_INT("chat_id", trace->chat_id),
+                  LOG_INT("duration_us", get_monotonic_time() - trace->start_time),
+                  LOG_INT("dropped_spans", atomic_load(&trace->spans_count) - written_spans),
+                  LOG_JSON("spans", spans)
+              },
+              5);
+}
+
+// Lists the spans in their start order as long as they fit, returns
+// the number of the listed spans.
+static int format_spans(char *text, const size_t text_size, Trace *trace)
+{
+    int spans_count = atomic_load(&trace->spans_count);
+
+    if (spans_count > MAX_TRACE_SPANS)
+        spans_count = MAX_TRACE_SPANS;
+
+    qsort(trace->spans, spans_count, sizeof *trace->spans, compare_spans);
+
+    // Two bytes are kept for the closing bracket and the terminator.
+    size_t size = 1;
+    text[0] = '[';
+
+    int written_spans = 0;
+
+    for (; written_spans < spans_count; ++written_spans)
+    {
+        const TraceSpan *span = &trace->spans[written_spans];
+
+        const int span_size = snprintf(text + size,
+                                       text_size - size - 1,
+                                       "%s{\"name\":\"%s\",\"depth\":%d,\"start_us\":%" PRIdFAST64
+                                       ",\"duration_us\":%" PRIdFAST64 "}",
+                                       written_spans ? "," : "",
+                                       span->name,
+                                       span->depth,
+                                       span->start - trace->start_time,
+                                       span->end - span->start);
+
+        if (span_size < 0 || (size_t) span_size >= text_size - size - 1)
+            break;
+
+        size += span_size;
+    }
+
+    text[size++] = ']';
+    text[size] = '\0';
+
+    return written_spans;
+}
+
+static int compare_spans(const void *a, const void *b)
+{
+    const TraceSpan *a_span = a;
+    const TraceSpan *b_span = b;
+
+    if (a_span->start != b_span->start)
+        return (a_span->start > b_span->start) - (a_span->start < b_span->start);
+
+    return a_span->depth - b_span->depth;
+}
+
+static int_fast64_t get_monotonic_time(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int_fast64_t) time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
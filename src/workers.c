@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "workers.h"
+
+typedef struct
+{
+    WorkFunction function;
+    void *work_arg;
+}
+Work;
+
+// Every worker serves its own queue, so works with the same key
+// run one after another in the order they were submitted.
+typedef struct
+{
+    Work queue[MAX_WORKER_QUEUE_SIZE];
+    int queue_head;
+    int queue_size;
+    int busy;
+    uint_fast64_t completed_works;
+    uint_fast64_t blocked_submits;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty_cond;
+    pthread_cond_t not_full_cond;
+}
+Worker;
+
+static void enqueue_work(Worker *worker, WorkFunction function, void *work_arg);
+static void *run_worker(void *worker_arg);
+
+// The worker after the sharded ones is the priority lane, its queue is
+// never behind the works of other chats.
+static Worker *workers;
+static int workers_size = 0;
+static uint_fast64_t priority_works = 0;
+
+static int admitted_works = 0;
+static uint_fast64_t shed_works = 0;
+static uint_fast64_t deferred_works = 0;
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond = PTHREAD_COND_INITIALIZER;
+
+void init_workers_module(const int workers_count)
+{
+    workers_size = workers_count > 0 ? workers_count : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (workers_size < 1)
+        workers_size = 1;
+    else if (workers_size > MAX_WORKERS)
+        workers_size = MAX_WORKERS;
+
+    if (!(workers = calloc(workers_size + 1, sizeof *workers)))
+        die("%s: %s: failed to allocate memory for workers",
+            __BASE_FILE__,
+            __func__);
+
+    for (int i = 0; i <= workers_size; ++i)
+    {
+        pthread_mutex_init(&workers[i].mutex, NULL);
+        pthread_cond_init(&workers[i].not_empty_cond, NULL);
+        pthread_cond_init(&workers[i].not_full_cond, NULL);
+
+        pthread_t worker_thread;
+
+        if (pthread_create(&worker_thread,
+                           NULL,
+                           run_worker,
+                           &workers[i]))
+            die("%s: %s: failed to create worker_thread",
+                __BASE_FILE__,
+                __func__);
+
+        pthread_detach(worker_thread);
+    }
+}
+
+void submit_work(const int_fast64_t key, WorkFunction function, void *work_arg)
+{
+    enqueue_work(&workers[(uint_fast64_t) key * 0x9E3779B97F4A7C15 % workers_size],
+                 function,
+                 work_arg);
+}
+
+void submit_priority_work(WorkFunction function, void *work_arg)
+{
+    Worker *worker = &workers[workers_size];
+
+    pthread_mutex_lock(&worker->mutex);
+    ++priority_works;
+    pthread_mutex_unlock(&worker->mutex);
+
+    enqueue_work(worker, function, work_arg);
+}
+
+// Returns WORK_ADMITTED if the work has to be submitted and finished with
+// finish_admitted_work(). Without can_wait an overloaded caller gets
+// WORK_DEFERRED and has to retry the work later.
+int admit_work(const int low_value, const int can_wait)
+{
+    pthread_mutex_lock(&admission_mutex);
+
+    if (low_value && admitted_works >= SHED_ADMITTED_WORKS)
+    {
+        ++shed_works;
+        pthread_mutex_unlock(&admission_mutex);
+
+        return WORK_SHED;
+    }
+
+    if (admitted_works >= MAX_ADMITTED_WORKS)
+    {
+        ++deferred_works;
+
+        if (!can_wait)
+        {
+            pthread_mutex_unlock(&admission_mutex);
+            return WORK_DEFERRED;
+        }
+
+        do
+            pthread_cond_wait(&admission_cond, &admission_mutex);
+        while (admitted_works >= MAX_ADMITTED_WORKS);
+    }
+
+    ++admitted_works;
+
+    pthread_mutex_unlock(&admission_mutex);
+
+    return WORK_ADMITTED;
+}
+
+void finish_admitted_work(void)
+{
+    pthread_mutex_lock(&admission_mutex);
+
+    --admitted_works;
+
+    pthread_cond_signal(&admission_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void get_workers_stats(WorkersStats *stats)
+{
+    stats->workers = workers_size;
+    stats->busy_workers = 0;
+    stats->queued_works = 0;
+    stats->max_queued_works = 0;
+    stats->completed_works = 0;
+    stats->blocked_submits = 0;
+
+    for (int i = 0; i <= workers_size; ++i)
+    {
+        Worker *worker = &workers[i];
+
+        pthread_mutex_lock(&worker->mutex);
+
+        stats->busy_workers += worker->busy;
+        stats->queued_works += worker->queue_size;
+        stats->completed_works += worker->completed_works;
+        stats->blocked_submits += worker->blocked_submits;
+
+        if ((uint_fast64_t) worker->queue_size > stats->max_queued_works)
+            stats->max_queued_works = worker->queue_size;
+
+        pthread_mutex_unlock(&worker->mutex);
+    }
+
+    pthread_mutex_lock(&workers[workers_size].mutex);
+    stats->priority_works = priority_works;
+    pthread_mutex_unlock(&workers[workers_size].mutex);
+
+    pthread_mutex_lock(&admission_mutex);
+
+    stats->admitted_works = admitted_works;
+    stats->shed_works = shed_works;
+    stats->deferred_works = deferred_works;
+
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+static void enqueue_work(Worker *worker, WorkFunction function, void *work_arg)
+{
+    pthread_mutex_lock(&worker->mutex);
+
+    // A full queue slows down the update source instead of dropping updates.
+    if (worker->queue_size == MAX_WORKER_QUEUE_SIZE)
+    {
+        ++worker->blocked_submits;
+
+        do
+            pthread_cond_wait(&worker->not_full_cond, &worker->mutex);
+        while (worker->queue_size == MAX_WORKER_QUEUE_SIZE);
+    }
+
+    Work *work = &worker->queue[(worker->queue_head + worker->queue_size) % MAX_WORKER_QUEUE_SIZE];
+    work->function = function;
+    work->work_arg = work_arg;
+
+    ++worker->queue_size;
+
+    pthread_cond_signal(&worker->not_empty_cond);
+    pthread_mutex_unlock(&worker->mutex);
+}
+
+static void *run_worker(void *worker_arg)
+{
+    Worker *worker = worker_arg;
+
+    pthread_mutex_lock(&worker->mutex);
+
+    for (;;)
+    {
+        while (!worker->queue_size)
+            pthread_cond_wait(&worker->not_empty_cond, &worker->mutex);
+
+        const Work work = worker->queue[worker->queue_head];
+
+        worker->queue_head = (worker->queue_head + 1) % MAX_WORKER_QUEUE_SIZE;
+        --worker->queue_size;
+        worker->busy = 1;
+
+        pthread_cond_signal(&worker->not_full_cond);
+        pthread_mutex_unlock(&worker->mutex);
+
+        work.function(work.work_arg);
+
+        pthread_mutex_lock(&worker->mutex);
+
+        worker->busy = 0;
+        ++worker->completed_works;
+    }
+
+    return NULL;
+}